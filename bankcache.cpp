@@ -0,0 +1,142 @@
+#include "bankcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "romfile.h"
+
+#ifdef BUILD_FOR_PC
+#include <chrono>
+#else
+#include <Arduino.h>
+#include "esp_heap_caps.h"
+#endif
+
+#define BANK_SIZE 0x4000
+// 8 MiB, the largest MBC5 ROM
+#define MAX_BANKS 512
+
+static struct rom_file rom;
+static unsigned int banks;
+static unsigned char *bank0;
+
+static unsigned char *pool;
+static int pool_size;
+static int16_t pool_bank[MAX_BANKS];  // Pool slot holding each bank, or -1
+static int16_t *slot_bank;            // Bank in each pool slot, or -1
+static uint32_t *slot_used;           // Value of use_clock when last selected
+static uint32_t use_clock;
+
+static uint32_t hits, misses, evictions, worst_us;
+
+static uint32_t now_us(void) {
+#ifdef BUILD_FOR_PC
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return micros();
+#endif
+}
+
+static unsigned char *alloc_banks(int n) {
+#ifdef BUILD_FOR_PC
+  return (unsigned char *)malloc(n * BANK_SIZE);
+#else
+  unsigned char *p = (unsigned char *)heap_caps_malloc(n * BANK_SIZE, MALLOC_CAP_SPIRAM);
+  return p ? p : (unsigned char *)malloc(n * BANK_SIZE);
+#endif
+}
+
+static bool read_bank(unsigned int n, unsigned char *dst) { return rom_file_read(&rom, n, 1, dst); }
+
+const unsigned char *bank_cache_open(const char *path, int pool_banks) {
+  if (!rom_file_open(&rom, path)) return NULL;
+  banks = rom.banks;
+
+  // No point in keeping more banks than there are
+  pool_size = pool_banks < (int)banks - 1 ? pool_banks : banks - 1;
+  bank0 = alloc_banks(1);
+  pool = alloc_banks(pool_size);
+  slot_bank = (int16_t *)malloc(pool_size * sizeof(*slot_bank));
+  slot_used = (uint32_t *)calloc(pool_size, sizeof(*slot_used));
+  if (!bank0 || !pool || !slot_bank || !slot_used || !read_bank(0, bank0)) {
+    printf("Failed to set up %d cached banks\n", pool_size);
+    bank_cache_close();
+    return NULL;
+  }
+  for (unsigned int i = 0; i < MAX_BANKS; i++) pool_bank[i] = -1;
+  for (int i = 0; i < pool_size; i++) slot_bank[i] = -1;
+  use_clock = 0;
+
+  printf("Streaming %u banks, %d cached\n", banks, pool_size);
+  return bank0;
+}
+
+void bank_cache_close(void) {
+  rom_file_close(&rom);
+  free(bank0);
+  free(pool);
+  free(slot_bank);
+  free(slot_used);
+  bank0 = pool = NULL;
+  slot_bank = NULL;
+  slot_used = NULL;
+  hits = misses = evictions = worst_us = 0;
+}
+
+const unsigned char *bank_cache_get(unsigned int n) {
+  if (n == 0) return bank0;
+
+  int slot = pool_bank[n];
+  if (slot >= 0) {
+    hits++;
+    slot_used[slot] = ++use_clock;
+    return &pool[slot * BANK_SIZE];
+  }
+
+  // Take a free slot or the least recently used one
+  uint32_t start = now_us();
+  slot = 0;
+  for (int i = 1; i < pool_size; i++) {
+    if (slot_used[i] < slot_used[slot]) slot = i;
+  }
+  if (slot_bank[slot] >= 0) {
+    pool_bank[slot_bank[slot]] = -1;
+    evictions++;
+  }
+
+  unsigned char *dst = &pool[slot * BANK_SIZE];
+  misses++;
+  if (read_bank(n, dst)) {
+    slot_bank[slot] = n;
+    pool_bank[n] = slot;
+    slot_used[slot] = ++use_clock;
+  } else {
+    // Open bus for now, and not cached so the next switch reads it again
+    printf("Failed to read bank %u\n", n);
+    memset(dst, 0xFF, BANK_SIZE);
+    slot_bank[slot] = -1;
+    slot_used[slot] = 0;
+  }
+
+  uint32_t elapsed = now_us() - start;
+  if (elapsed > worst_us) worst_us = elapsed;
+  return dst;
+}
+
+const unsigned char *bank_cache_peek(unsigned int n) {
+  if (n == 0) return bank0;
+  return pool_bank[n] >= 0 ? &pool[pool_bank[n] * BANK_SIZE] : NULL;
+}
+
+unsigned int bank_cache_get_banks(void) { return banks; }
+
+void bank_cache_read_stats(struct bank_cache_stats *stats) {
+  stats->hits = hits;
+  stats->misses = misses;
+  stats->evictions = evictions;
+  stats->worst_us = worst_us;
+  hits = misses = evictions = worst_us = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef BANKCACHE_H
+#define BANKCACHE_H
+#include <stdint.h>
+
+/*
+ * ROM banks read from the ROM file on demand, decompressing them if the file
+ * is compressed (see romfile.h). Bank 0 is read when the file
+ * is opened and kept; the switchable banks are read the first time they are
+ * selected and kept in a pool of ROM_BANK_POOL banks, evicting the least
+ * recently selected one. Only the pool and bank 0 need memory, so ROMs
+ * larger than free PSRAM still run and the game starts after one bank.
+ */
+
+// Switchable banks kept in memory, 16 KiB each
+#ifndef ROM_BANK_POOL
+#define ROM_BANK_POOL 16
+#endif
+
+struct bank_cache_stats {
+  uint32_t hits, misses, evictions;
+  uint32_t worst_us;  // Longest bank_cache_get(), a miss reading the card
+};
+
+// Opens the ROM file and reads bank 0, which it returns, or NULL on error
+const unsigned char *bank_cache_open(const char *path, int pool_banks);
+void bank_cache_close(void);
+// Returns bank n of the file, n must be below bank_cache_get_banks()
+const unsigned char *bank_cache_get(unsigned int n);
+// Bank n if it is in the pool (or bank 0), else NULL. Does not count as a
+// use of the bank.
+const unsigned char *bank_cache_peek(unsigned int n);
+// Banks in the file
+unsigned int bank_cache_get_banks(void);
+// Counters since the previous call
+void bank_cache_read_stats(struct bank_cache_stats *stats);
+#endif
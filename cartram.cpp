@@ -0,0 +1,421 @@
+#include "cartram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "loader.h"
+#include "rom.h"
+#include "rtc.h"
+#include "state.h"
+
+#ifdef BUILD_FOR_PC
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+#else
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <unistd.h>
+#include "esp_heap_caps.h"
+#endif
+
+#define BANK_SIZE 0x2000
+// And one for the clock footer
+#define PAGES (CART_RAM_MAX / CART_RAM_PAGE + 1)
+// Room for ".sav" after a catalogue path
+#define SAV_PATH_LEN 160
+
+static unsigned char *window;  // 0xA000 in the memory map
+static unsigned char *store;   // All banks, then the clock footer
+static unsigned int size, banks, window_size;
+static unsigned int file_size;  // Of the .sav file
+static bool enabled;
+static unsigned int bank;
+static unsigned int rtc_reg;  // Clock register in the window, 0 for RAM
+
+/* Saved for snapshots, along with the RAM and the clock */
+#define CART_RAM_STATE(X) X(enabled) X(bank) X(rtc_reg)
+
+// Write-back, pages are staged by the emulator and written by the task
+static bool battery;
+static uint8_t page_dirty[PAGES];
+static unsigned int dirty_pages;
+static bool written;  // Since the previous cart_ram_poll()
+static uint32_t quiet_since;  // In us
+static unsigned char *staging;
+static uint8_t page_staged[PAGES];
+static std::atomic<bool> flush_running;
+static uint32_t flush_start, stage_us;
+
+#ifdef BUILD_FOR_PC
+static unsigned char *sav_map;
+#else
+static FILE *sav_file;
+#endif
+
+static uint32_t now_us(void) {
+#ifdef BUILD_FOR_PC
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return micros();
+#endif
+}
+
+static unsigned char *alloc_ram(size_t n) {
+#ifdef BUILD_FOR_PC
+  return (unsigned char *)calloc(1, n);
+#else
+  unsigned char *p = (unsigned char *)heap_caps_calloc(1, n, MALLOC_CAP_SPIRAM);
+  return p ? p : (unsigned char *)calloc(1, n);
+#endif
+}
+
+static bool has_battery(unsigned char type) {
+  switch (type) {
+    case 0x03:
+    case 0x06:
+    case 0x09:
+    case 0x0D:
+    case 0x0F:
+    case 0x10:
+    case 0x13:
+    case 0x17:
+    case 0x1B:
+    case 0x1E:
+    case 0xFF:
+      return true;
+  }
+  return false;
+}
+
+static unsigned int header_size(unsigned char code) {
+  static const unsigned int sizes[] = {0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000};
+  return code < sizeof(sizes) / sizeof(sizes[0]) ? sizes[code] : 0;
+}
+
+static unsigned int file_pages(void) { return (file_size + CART_RAM_PAGE - 1) / CART_RAM_PAGE; }
+
+// The bytes of the file from offset on, at most len
+static unsigned int file_len(unsigned int offset, unsigned int len) {
+  return file_size - offset < len ? file_size - offset : len;
+}
+
+static void mark_dirty(unsigned int page) {
+  if (!page_dirty[page]) {
+    page_dirty[page] = 1;
+    dirty_pages++;
+  }
+  written = true;
+}
+
+/* Puts the clock in the footer after the RAM */
+static void store_footer(void) {
+  if (!store) return;
+  rtc_save_footer(&store[size]);
+  mark_dirty(size / CART_RAM_PAGE);
+}
+
+/* Shows the selected bank or clock register in the window, or 0xFF while
+ * disabled */
+static void map_window(void) {
+  if (rtc_reg) {
+    memset(window, enabled ? rtc_read(rtc_reg) : 0xFF, BANK_SIZE);
+    return;
+  }
+  if (enabled && window_size) memcpy(window, &store[bank * BANK_SIZE], window_size);
+  memset(&window[enabled ? window_size : 0], 0xFF, BANK_SIZE - (enabled ? window_size : 0));
+}
+
+/* .sav file */
+
+static void sav_path_for(const char *rom_path, char *path) {
+  snprintf(path, SAV_PATH_LEN, "%s", rom_path);
+  char *dot = strrchr(path, '.');
+  char *slash = strrchr(path, '/');
+  if (!dot || (slash && dot < slash)) dot = path + strlen(path);
+  snprintf(dot, SAV_PATH_LEN - (dot - path), ".sav");
+}
+
+/* sav_open() returns the length the file had, or -1 */
+#ifdef BUILD_FOR_PC
+static long sav_open(const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+  if (fd == -1) return -1;
+  // Grows a new or short file with zeros, like the fresh RAM
+  if (fstat(fd, &st) == -1 || (st.st_size < (off_t)file_size && ftruncate(fd, file_size) == -1)) {
+    close(fd);
+    return -1;
+  }
+  void *p = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) return -1;
+  sav_map = (unsigned char *)p;
+  memcpy(store, sav_map, file_size);
+  return st.st_size;
+}
+
+static void sav_close(void) {
+  if (sav_map) munmap(sav_map, file_size);
+  sav_map = NULL;
+}
+
+static void sav_write(unsigned int offset, unsigned int len) {
+  memcpy(&sav_map[offset], &staging[offset], len);
+}
+
+static void sav_sync(unsigned int first, unsigned int end) {
+  long page = sysconf(_SC_PAGESIZE);
+  unsigned int start = first & ~(page - 1);
+  msync(&sav_map[start], end - start, MS_SYNC);
+}
+#else
+static long sav_open(const char *path) {
+  sav_file = loader_open(path, "r+b");
+  if (!sav_file) sav_file = loader_open(path, "w+b");
+  if (!sav_file) return -1;
+
+  fseek(sav_file, 0, SEEK_END);
+  long length = ftell(sav_file);
+  if (length > 0) loader_read(sav_file, 0, store, length < (long)file_size ? length : file_size);
+  // A new or short file is written out whole once
+  if (length < (long)file_size && !loader_write(sav_file, 0, store, file_size)) {
+    fclose(sav_file);
+    sav_file = NULL;
+    return -1;
+  }
+  fsync(fileno(sav_file));
+  return length;
+}
+
+static void sav_close(void) {
+  if (sav_file) fclose(sav_file);
+  sav_file = NULL;
+}
+
+static void sav_write(unsigned int offset, unsigned int len) {
+  if (!loader_write(sav_file, offset, &staging[offset], len)) printf("Failed to write the save\n");
+}
+
+static void sav_sync(unsigned int first, unsigned int end) { fsync(fileno(sav_file)); }
+#endif
+
+void cart_ram_init(unsigned char *w) {
+  const unsigned char *header = rom_get_bank(0);
+
+  // Waits for the write-back, which still uses the old sizes
+  cart_ram_flush();
+  sav_close();
+  free(store);
+  free(staging);
+  window = w;
+  size = rom_get_mapper() == MBC2 ? 512 : header_size(header[0x149]);
+  banks = (size + BANK_SIZE - 1) / BANK_SIZE;
+  window_size = size < BANK_SIZE ? size : BANK_SIZE;
+  rtc_init(header[0x147]);
+  file_size = size + (rtc_present() ? RTC_FOOTER_SIZE : 0);
+  store = file_size ? alloc_ram(file_size) : NULL;
+  if (!store) size = banks = window_size = file_size = 0;
+  staging = NULL;
+  battery = false;
+  bank = 0;
+  rtc_reg = 0;
+  // No enable register without a mapper
+  enabled = rom_get_mapper() == NROM;
+  dirty_pages = 0;
+  memset(page_dirty, 0, sizeof(page_dirty));
+  map_window();
+  if (size) printf("Cart RAM: %u bytes in %u banks\n", size, banks);
+  if (rtc_present()) printf("Cart clock: MBC3\n");
+}
+
+unsigned int cart_ram_get_size(void) { return size; }
+
+bool cart_ram_load(const char *rom_path) {
+  char path[SAV_PATH_LEN];
+
+  if (!file_size || !has_battery(rom_get_bank(0)[0x147])) return false;
+  staging = alloc_ram(file_size);
+  sav_path_for(rom_path, path);
+  long length = staging ? sav_open(path) : -1;
+  if (length < 0) {
+    printf("Cannot keep the save in %s\n", path);
+    free(staging);
+    staging = NULL;
+    return false;
+  }
+  battery = true;
+  if (rtc_present()) {
+    rtc_load_footer(&store[size], length > (long)size ? length - size : 0);
+    // Without one the clock starts now, and the file should say so
+    if (length < (long)file_size) store_footer();
+  }
+  map_window();
+  quiet_since = now_us();
+  printf("Save file: %s\n", path);
+  return true;
+}
+
+/* Mapper registers */
+
+void cart_ram_enable(bool on) {
+  if (on == enabled) return;
+  enabled = on;
+  map_window();
+}
+
+void cart_ram_select_bank(unsigned int n) {
+  n = banks ? n % banks : 0;
+  if (n == bank && !rtc_reg) return;
+  bank = n;
+  rtc_reg = 0;
+  if (enabled) map_window();
+}
+
+void cart_ram_select_rtc(unsigned int reg) {
+  if (!rtc_present() || reg == rtc_reg) return;
+  rtc_reg = reg;
+  if (enabled) map_window();
+}
+
+void cart_ram_latch_rtc(unsigned char v) {
+  rtc_latch(v);
+  if (rtc_reg && enabled) map_window();
+}
+
+void cart_ram_write(unsigned short addr, unsigned char v) {
+  unsigned int offset = addr - 0xA000;
+
+  if (!enabled) return;
+  if (rtc_reg) {
+    rtc_write(rtc_reg, v);
+    map_window();
+    store_footer();
+    return;
+  }
+  if (offset >= window_size) return;
+  window[offset] = v;
+  offset += bank * BANK_SIZE;
+  store[offset] = v;
+  mark_dirty(offset / CART_RAM_PAGE);
+}
+
+/* Write-back */
+
+static void write_back(void *arg) {
+  unsigned int pages = 0, first = file_size, end = 0;
+
+  for (unsigned int p = 0; p < file_pages(); p++) {
+    if (!page_staged[p]) continue;
+    // Runs of pages in one write
+    unsigned int q = p;
+    while (q < file_pages() && page_staged[q]) q++;
+    sav_write(p * CART_RAM_PAGE, file_len(p * CART_RAM_PAGE, (q - p) * CART_RAM_PAGE));
+    if (first > p * CART_RAM_PAGE) first = p * CART_RAM_PAGE;
+    end = p * CART_RAM_PAGE + file_len(p * CART_RAM_PAGE, (q - p) * CART_RAM_PAGE);
+    pages += q - p;
+    p = q;
+  }
+  if (pages) sav_sync(first, end);
+  printf("save: %u pages written in %.1f ms, %u us in the emulator\n", pages,
+         (now_us() - flush_start) / 1000.0f, stage_us);
+  flush_running.store(false, std::memory_order_release);
+#ifndef BUILD_FOR_PC
+  vTaskDelete(NULL);
+#endif
+}
+
+/* Copies the dirty pages aside for write_back(), which runs on its own */
+static void start_flush(void) {
+  uint32_t start = now_us();
+
+  for (unsigned int p = 0; p < file_pages(); p++) {
+    page_staged[p] = page_dirty[p];
+    if (!page_dirty[p]) continue;
+    memcpy(&staging[p * CART_RAM_PAGE], &store[p * CART_RAM_PAGE], file_len(p * CART_RAM_PAGE, CART_RAM_PAGE));
+    page_dirty[p] = 0;
+  }
+  dirty_pages = 0;
+  flush_start = now_us();
+  stage_us = flush_start - start;
+  flush_running = true;
+#ifdef BUILD_FOR_PC
+  std::thread(write_back, (void *)NULL).detach();
+#else
+  xTaskCreatePinnedToCore(write_back, "saveWriter", 4096, NULL, 1, NULL, 0);
+#endif
+}
+
+void cart_ram_poll(void) {
+  if (!battery) return;
+  if (rtc_present() && rtc_footer_due()) store_footer();
+  uint32_t now = now_us();
+  if (written) {
+    written = false;
+    quiet_since = now;
+    return;
+  }
+  if (dirty_pages && !flush_running.load(std::memory_order_acquire) &&
+      now - quiet_since >= CART_RAM_QUIET_MS * 1000u)
+    start_flush();
+}
+
+static void wait_flush(void) {
+  while (flush_running.load(std::memory_order_acquire)) {
+#ifdef BUILD_FOR_PC
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#else
+    vTaskDelay(1);
+#endif
+  }
+}
+
+void cart_ram_flush(void) {
+  if (!battery) return;
+  wait_flush();
+  if (dirty_pages) start_flush();
+  wait_flush();
+}
+
+/* Snapshots */
+
+size_t cart_ram_state_size(void) { return size CART_RAM_STATE(STATE_SIZE) + rtc_state_size(); }
+
+uint8_t *cart_ram_save_state(uint8_t *p) {
+  memcpy(p, store, size);
+  p += size;
+  CART_RAM_STATE(STATE_SAVE)
+  return rtc_save_state(p);
+}
+
+const uint8_t *cart_ram_load_state(const uint8_t *p) {
+  // Pages that change are written back like written ones
+  for (unsigned int i = 0; i < size; i += CART_RAM_PAGE) {
+    unsigned int n = size - i < CART_RAM_PAGE ? size - i : CART_RAM_PAGE;
+    if (!memcmp(&store[i], &p[i], n)) continue;
+    memcpy(&store[i], &p[i], n);
+    mark_dirty(i / CART_RAM_PAGE);
+  }
+  p += size;
+  // The window is restored with the rest of the memory map
+  CART_RAM_STATE(STATE_LOAD)
+  p = rtc_load_state(p);
+  if (rtc_present()) {
+    uint8_t footer[RTC_FOOTER_SIZE];
+    rtc_save_footer(footer);
+    // Only a clock the game set again is worth a write, not a new latch
+    if (memcmp(footer, &store[size], 20) || memcmp(&footer[40], &store[size + 40], 8)) store_footer();
+  }
+  return p;
+}
@@ -0,0 +1,56 @@
+#ifndef CARTRAM_H
+#define CARTRAM_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Cartridge RAM at 0xA000-0xBFFF, sized from header byte 0x149 (512 bytes
+ * built into MBC2 carts) and switched in 8 KiB banks by the mapper. The
+ * selected bank is copied into the memory map like the ROM bank, so reads
+ * cost nothing extra; writes go through cart_ram_write(), which also marks
+ * their 512-byte page dirty. While the RAM is disabled the window reads
+ * 0xFF and writes are dropped, as on a cart.
+ *
+ * With a battery the RAM is kept in a .sav file next to the ROM. Once the
+ * game has not written for CART_RAM_QUIET_MS, cart_ram_poll() copies the
+ * dirty pages aside and a background task writes only those, so saving
+ * never holds up emulation. The host maps the .sav file into memory.
+ *
+ * An MBC3 clock (see rtc.h) shows its registers through the same window
+ * and keeps its footer after the RAM in the .sav file.
+ */
+
+#define CART_RAM_PAGE 512
+// 16 banks of 8 KiB, the most a mapper can switch
+#define CART_RAM_MAX 0x20000
+
+// Time without writes before dirty pages are written back
+#ifndef CART_RAM_QUIET_MS
+#define CART_RAM_QUIET_MS 1000
+#endif
+
+// Sizes the RAM for the loaded ROM, window is 0xA000 in the memory map
+void cart_ram_init(unsigned char *window);
+// Reads the .sav file of the ROM at rom_path if the cart has a battery,
+// creating it if there is none yet. Returns false if the RAM is not kept.
+bool cart_ram_load(const char *rom_path);
+unsigned int cart_ram_get_size(void);
+
+// Mapper registers
+void cart_ram_enable(bool on);
+void cart_ram_select_bank(unsigned int n);
+// Shows clock register reg, 0x08-0x0C, instead of a bank
+void cart_ram_select_rtc(unsigned int reg);
+void cart_ram_latch_rtc(unsigned char v);
+// A write to 0xA000-0xBFFF
+void cart_ram_write(unsigned short addr, unsigned char v);
+
+// Call once a frame, starts a write-back when the game has gone quiet
+void cart_ram_poll(void);
+// Writes back every dirty page and waits for it, e.g. before exiting
+void cart_ram_flush(void);
+
+size_t cart_ram_state_size(void);
+uint8_t *cart_ram_save_state(uint8_t *p);
+const uint8_t *cart_ram_load_state(const uint8_t *p);
+#endif
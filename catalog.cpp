@@ -0,0 +1,307 @@
+#include "catalog.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "romfile.h"
+
+#ifdef BUILD_FOR_PC
+#include <chrono>
+#else
+#include <Arduino.h>
+#endif
+
+#define INDEX_NAME ".romindex"
+#define INDEX_MAGIC 0x58444E49  // "INDX"
+#define INDEX_VERSION 2  // 2: .gbz files are ROMs too
+// Entries read from the index at a time
+#define PAGE_ENTRIES 16
+
+/* Index file: header, entries, then one record per directory */
+struct index_header {
+  uint32_t magic, version;
+  uint32_t dirs, entries;
+};
+
+struct dir_record {
+  char path[CATALOG_PATH_LEN];
+  uint32_t mtime;
+  uint32_t names;  // Entries in the directory, of any kind but hidden
+  uint32_t hash;   // Of their names
+  uint32_t first, count;  // Its ROMs in the index
+};
+
+static FILE *index_file;
+static int count;
+static struct catalog_entry page[PAGE_ENTRIES];
+static int page_first = -1;
+
+// Directories of the previous index, and of the one being built
+static struct dir_record *old_dirs, *new_dirs;
+static uint32_t old_dir_count, new_dir_count, new_dir_cap;
+static FILE *old_file, *new_file;
+static uint32_t new_entries;
+static uint32_t headers_read;
+
+static uint32_t now_ms(void) {
+#ifdef BUILD_FOR_PC
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return millis();
+#endif
+}
+
+static bool is_rom(const char *name) {
+  const char *ext = strrchr(name, '.');
+  return ext && (!strcasecmp(ext, ".gb") || !strcasecmp(ext, ".gbz"));
+}
+
+static bool is_subdir(const struct dirent *d) {
+  return d->d_type == DT_DIR && d->d_name[0] != '.';
+}
+
+static long entry_offset(uint32_t i) {
+  return sizeof(struct index_header) + (long)i * sizeof(struct catalog_entry);
+}
+
+/* Describes the directory the way the index does, without its ROMs */
+static bool scan_dir(const char *path, struct dir_record *r) {
+  struct stat st;
+  DIR *dir = opendir(path);
+  if (!dir) return false;
+
+  memset(r, 0, sizeof(*r));
+  snprintf(r->path, sizeof(r->path), "%s", path);
+  r->mtime = stat(path, &st) == 0 ? (uint32_t)st.st_mtime : 0;
+  r->hash = 2166136261u;
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL) {
+    // Leaves out the index itself
+    if (d->d_name[0] == '.') continue;
+    for (const char *c = d->d_name; *c; c++) r->hash = (r->hash ^ (uint8_t)*c) * 16777619u;
+    r->hash = (r->hash ^ d->d_type) * 16777619u;
+    r->names++;
+  }
+  closedir(dir);
+  return true;
+}
+
+static bool same_dir(const struct dir_record *a, const struct dir_record *b) {
+  return !strcmp(a->path, b->path) && a->mtime == b->mtime && a->names == b->names &&
+         a->hash == b->hash;
+}
+
+static void read_header(const char *path, struct catalog_entry *e) {
+  static const uint8_t logo[] = {0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B};
+  uint8_t h[0x150];
+  struct stat st;
+
+  memset(e, 0, sizeof(*e));
+  snprintf(e->path, sizeof(e->path), "%s", path);
+  if (stat(path, &st) == 0) e->file_size = st.st_size;
+  headers_read++;
+  if (!rom_file_read_header(path, h)) return;
+
+  memcpy(e->title, &h[0x134], 16);
+  e->cart_type = h[0x147];
+  e->rom_size = h[0x148];
+  e->ram_size = h[0x149];
+  uint8_t checksum = 0;
+  for (int i = 0x134; i <= 0x14C; i++) checksum = checksum - h[i] - 1;
+  e->header_ok = !memcmp(&h[0x104], logo, sizeof(logo)) && h[0x14D] == checksum;
+}
+
+/* Walks the tree. Without build it only checks that every directory matches
+ * the previous index, in the same order; with build it writes the entries of
+ * the new index, copying those of unchanged directories. Returns false on a
+ * mismatch, or when out of memory, which leaves the index incomplete. */
+static bool walk(const char *path, int depth, bool build) {
+  struct dir_record r;
+  char child[CATALOG_PATH_LEN];
+
+  // A directory that vanished during the build is left out
+  if (!scan_dir(path, &r)) return build;
+  if (!build) {
+    if (new_dir_count >= old_dir_count || !same_dir(&r, &old_dirs[new_dir_count])) return false;
+    new_dir_count++;
+  } else {
+    const struct dir_record *old = NULL;
+    for (uint32_t i = 0; i < old_dir_count && !old; i++) {
+      if (same_dir(&r, &old_dirs[i])) old = &old_dirs[i];
+    }
+    r.first = new_entries;
+    if (old) {
+      struct catalog_entry e;
+      for (uint32_t i = 0; i < old->count; i++) {
+        fseek(old_file, entry_offset(old->first + i), SEEK_SET);
+        if (fread(&e, sizeof(e), 1, old_file) != 1) break;
+        fwrite(&e, sizeof(e), 1, new_file);
+        r.count++;
+      }
+    } else {
+      DIR *dir = opendir(path);
+      struct dirent *d;
+      while (dir && (d = readdir(dir)) != NULL) {
+        if (d->d_type != DT_REG || !is_rom(d->d_name)) continue;
+        if (snprintf(child, sizeof(child), "%s/%s", path, d->d_name) >= (int)sizeof(child)) {
+          printf("Path too long: %s/%s\n", path, d->d_name);
+          continue;
+        }
+        struct catalog_entry e;
+        read_header(child, &e);
+        fwrite(&e, sizeof(e), 1, new_file);
+        r.count++;
+      }
+      if (dir) closedir(dir);
+    }
+    new_entries += r.count;
+    if (new_dir_count == new_dir_cap) {
+      uint32_t cap = new_dir_cap ? new_dir_cap * 2 : 16;
+      struct dir_record *dirs = (struct dir_record *)realloc(new_dirs, cap * sizeof(*new_dirs));
+      if (!dirs) return false;
+      new_dirs = dirs;
+      new_dir_cap = cap;
+    }
+    new_dirs[new_dir_count++] = r;
+  }
+
+  if (depth >= CATALOG_MAX_DEPTH) return true;
+  DIR *dir = opendir(path);
+  if (!dir) return true;
+  // Names first, so no directory is held open during the recursion
+  int subdirs = 0;
+  char (*names)[CATALOG_PATH_LEN] = NULL;
+  struct dirent *d;
+  bool ok = true;
+  while (ok && (d = readdir(dir)) != NULL) {
+    if (!is_subdir(d)) continue;
+    char(*grown)[CATALOG_PATH_LEN] =
+        (char(*)[CATALOG_PATH_LEN])realloc(names, (subdirs + 1) * CATALOG_PATH_LEN);
+    if (!grown) {
+      ok = false;
+      break;
+    }
+    names = grown;
+    if (snprintf(names[subdirs], CATALOG_PATH_LEN, "%s/%s", path, d->d_name) < CATALOG_PATH_LEN)
+      subdirs++;
+  }
+  closedir(dir);
+  for (int i = 0; i < subdirs && ok; i++) ok = walk(names[i], depth + 1, build);
+  free(names);
+  return ok;
+}
+
+static void load_old_index(const char *path) {
+  struct index_header h;
+
+  old_dir_count = 0;
+  old_file = fopen(path, "rb");
+  if (!old_file) return;
+  if (fread(&h, sizeof(h), 1, old_file) != 1 || h.magic != INDEX_MAGIC || h.version != INDEX_VERSION)
+    return;
+  old_dirs = (struct dir_record *)malloc(h.dirs * sizeof(*old_dirs) + 1);
+  fseek(old_file, entry_offset(h.entries), SEEK_SET);
+  if (old_dirs && fread(old_dirs, sizeof(*old_dirs), h.dirs, old_file) == h.dirs) old_dir_count = h.dirs;
+}
+
+static bool build_index(const char *root, const char *path, const char *tmp) {
+  struct index_header h = {INDEX_MAGIC, INDEX_VERSION, 0, 0};
+
+  new_file = fopen(tmp, "wb");
+  if (!new_file) return false;
+  fwrite(&h, sizeof(h), 1, new_file);
+  new_dir_count = new_entries = 0;
+  bool ok = walk(root, 0, true);
+  fwrite(new_dirs, sizeof(*new_dirs), new_dir_count, new_file);
+  h.dirs = new_dir_count;
+  h.entries = new_entries;
+  fseek(new_file, 0, SEEK_SET);
+  fwrite(&h, sizeof(h), 1, new_file);
+  ok = ok && !ferror(new_file);
+  fclose(new_file);
+  if (old_file) fclose(old_file);
+  old_file = NULL;
+  if (!ok) {
+    remove(tmp);
+    return false;
+  }
+  // FAT cannot rename over an existing file
+  remove(path);
+  if (rename(tmp, path) != 0) return false;
+
+  // Writing the index touched the root, which is otherwise unchanged
+  struct dir_record root_now;
+  if (!new_dir_count || !scan_dir(root, &root_now)) return true;
+  new_dirs[0].mtime = root_now.mtime;
+  FILE *f = fopen(path, "r+b");
+  if (!f) return true;
+  fseek(f, entry_offset(new_entries), SEEK_SET);
+  fwrite(&new_dirs[0], sizeof(new_dirs[0]), 1, f);
+  fclose(f);
+  return true;
+}
+
+int catalog_open(const char *root) {
+  char path[CATALOG_PATH_LEN], tmp[CATALOG_PATH_LEN];
+  uint32_t start = now_ms();
+
+  DIR *dir = opendir(root);
+  if (!dir) {
+    printf("Failed to open directory: %s\n", root);
+    return -1;
+  }
+  closedir(dir);
+  snprintf(path, sizeof(path), "%s/" INDEX_NAME, root);
+  snprintf(tmp, sizeof(tmp), "%s/" INDEX_NAME ".tmp", root);
+
+  if (index_file) fclose(index_file);
+  index_file = NULL;
+  page_first = -1;
+  headers_read = 0;
+
+  load_old_index(path);
+  new_dir_count = 0;
+  bool valid = old_dir_count && walk(root, 0, false) && new_dir_count == old_dir_count;
+  if (!valid && !build_index(root, path, tmp)) printf("Failed to write %s\n", path);
+  if (old_file) fclose(old_file);
+  old_file = NULL;
+  free(old_dirs);
+  free(new_dirs);
+  old_dirs = new_dirs = NULL;
+  new_dir_cap = 0;
+
+  struct index_header h;
+  index_file = fopen(path, "rb");
+  count = index_file && fread(&h, sizeof(h), 1, index_file) == 1 && h.magic == INDEX_MAGIC ? h.entries : 0;
+  printf("catalog: %d ROMs, index %s, %u headers read, %u ms\n", count, valid ? "valid" : "rebuilt",
+         headers_read, now_ms() - start);
+  return count;
+}
+
+int catalog_get_count(void) { return count; }
+
+bool catalog_get(int i, struct catalog_entry *e) {
+  if (i < 0 || i >= count) return false;
+  if (page_first < 0 || i < page_first || i >= page_first + PAGE_ENTRIES) {
+    page_first = i - i % PAGE_ENTRIES;
+    int n = count - page_first < PAGE_ENTRIES ? count - page_first : PAGE_ENTRIES;
+    fseek(index_file, entry_offset(page_first), SEEK_SET);
+    if (fread(page, sizeof(*page), n, index_file) != (size_t)n) {
+      page_first = -1;
+      return false;
+    }
+  }
+  *e = page[i - page_first];
+  return true;
+}
+
+const char *catalog_name(const struct catalog_entry *e) {
+  const char *slash = strrchr(e->path, '/');
+  return slash ? slash + 1 : e->path;
+}
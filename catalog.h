@@ -0,0 +1,38 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+#include <stdint.h>
+
+/*
+ * ROM catalogue of a directory tree. Every ROM file, plain or compressed
+ * (.gb or .gbz), is described by the fields of its 0x150-byte header, kept
+ * in an index file at the root so only new or changed directories are read
+ * at boot. A directory is unchanged when its modification time, its number
+ * of entries and a hash of their names match the index (FAT does not update
+ * directory times when files are added, the names catch that). Entries are
+ * read from the index file when needed, a page at a time, so the catalogue
+ * can hold thousands of ROMs.
+ */
+
+#define CATALOG_PATH_LEN 128
+// Subdirectory levels scanned below the root
+#define CATALOG_MAX_DEPTH 8
+
+struct catalog_entry {
+  char path[CATALOG_PATH_LEN];  // Full path of the file
+  char title[17];
+  uint8_t cart_type;   // Header byte 0x147
+  uint8_t rom_size;    // Header byte 0x148
+  uint8_t ram_size;    // Header byte 0x149
+  uint8_t header_ok;   // Logo and header checksum match
+  uint32_t file_size;
+};
+
+// Scans the tree under root, updating its index. Returns the number of ROMs,
+// or -1 if root cannot be read.
+int catalog_open(const char *root);
+int catalog_get_count(void);
+// Reads entry i, returns false if there is none
+bool catalog_get(int i, struct catalog_entry *e);
+// File name part of an entry's path
+const char *catalog_name(const struct catalog_entry *e);
+#endif
@@ -3,6 +3,7 @@
 #include "interrupt.h"
 #include "mem.h"
 #include "rom.h"
+#include "state.h"
 
 #define set_HL(x)             \
   do {                        \
@@ -77,6 +78,21 @@ void cpu_init(void) {
   c.cycles = 0;
 }
 
+/* Saved for snapshots */
+#define CPU_STATE(X) X(c) X(halted)
+
+size_t cpu_state_size(void) { return 0 CPU_STATE(STATE_SIZE); }
+
+uint8_t *cpu_save_state(uint8_t *p) {
+  CPU_STATE(STATE_SAVE)
+  return p;
+}
+
+const uint8_t *cpu_load_state(const uint8_t *p) {
+  CPU_STATE(STATE_LOAD)
+  return p;
+}
+
 static void RLC(unsigned char reg) {
   unsigned char t, old;
 
@@ -1,9 +1,15 @@
 #ifndef CPU_H
 #define CPU_H
+#include <stddef.h>
+#include <stdint.h>
+
 #include "rom.h"
 void cpu_init(void);
 unsigned int cpu_cycle(void);
 unsigned short cpu_get_pc();
 unsigned int cpu_get_cycles(void);
 void cpu_interrupt(unsigned short);
+size_t cpu_state_size(void);
+uint8_t *cpu_save_state(uint8_t *p);
+const uint8_t *cpu_load_state(const uint8_t *p);
 #endif
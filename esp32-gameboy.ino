@@ -1,19 +1,108 @@
 #include <esp32-hal.h>
 #include <stdio.h>
 
+#include "bankcache.h"
+#include "cartram.h"
+#include "catalog.h"
 #include "cpu.h"
+#include "framequeue.h"
+#include "latency.h"
 #include "lcd.h"
+#include "loader.h"
 #include "mem.h"
+#include "pacer.h"
+#include "pixel.h"
 #include "rom.h"
+#include "romfile.h"
+#include "romprovider.h"
+#include "runahead.h"
 #include "sd.h"
 #include "sdl.h"
+#include "stream.h"
 #include "timer.h"
 
+//#define PERF_REPORT
+// Read ROM banks from the card as they are selected, even if the ROM would fit
+// in PSRAM or flash. ROMs that fit nowhere are always streamed.
+//#define ROM_STREAM_BANKS
+
+#define REPORT_INTERVAL 60
+
 static constexpr uint32_t emulator_cpu_freq = 4200000 / 4; //Eventuell Anpassbar
-static constexpr uint32_t frames_per_sec = 60;
 static uint32_t cpu_freq = 0;
-static uint32_t cycles_per_frame = 0;
-static uint32_t cycles_in_micro_sec = 0;
+
+// Fast-forward while SELECT and RIGHT are held
+#define FAST_FORWARD_BUTTONS 0x4
+#define FAST_FORWARD_DIRECTIONS 0x1
+
+#ifdef PERF_REPORT
+#define HEAT_TOP 8
+
+/* Prints the hottest banks, * marks the ones in internal SRAM */
+static void print_bank_heat(void) {
+  const uint32_t *heat = mem_get_bank_heat();
+  int top[HEAT_TOP];
+  int n = 0;
+
+  for (int b = 0; b < MEM_HEAT_BANKS; b++) {
+    if (!heat[b]) continue;
+    int i = n < HEAT_TOP ? n++ : HEAT_TOP;
+    for (; i > 0 && heat[top[i - 1]] < heat[b]; i--) {
+      if (i < HEAT_TOP) top[i] = top[i - 1];
+    }
+    if (i < HEAT_TOP) top[i] = b;
+  }
+  printf("bank heat:");
+  for (int i = 0; i < n; i++) {
+    printf(" %d%s:%u", top[i], rom_is_hot_bank(top[i]) ? "*" : "", heat[top[i]]);
+  }
+  printf(", %u promoted to SRAM\n", rom_get_hot_promotions());
+}
+#endif
+
+static uint32_t load_start_us;
+
+/* Logs the time to the first frame once the whole ROM is in */
+static void log_startup(void) {
+  static uint32_t first_frame_us;
+  static bool logged;
+
+  if (logged) return;
+  if (!first_frame_us) first_frame_us = micros() - load_start_us;
+  uint32_t load_us = rom_provider_load_us();
+  if (!load_us) return;
+  struct loader_stats card;
+  loader_read_stats(&card);
+  printf("startup: first frame after %u ms, ROM loaded after %u ms, %u ms waiting for banks\n",
+         first_frame_us / 1000, load_us / 1000, rom_provider_wait_us() / 1000);
+  if (card.us) printf("card reads: %u KiB at %.2f MB/s\n", card.bytes / 1024, (float)card.bytes / card.us);
+  struct rom_file_stats unpack;
+  rom_file_read_stats(&unpack);
+  if (unpack.us) {
+    printf("decompression: %u KiB from %u KiB in %u ms, %.1f MB/s\n", unpack.unpacked / 1024,
+           unpack.packed / 1024, unpack.us / 1000, (float)unpack.unpacked / unpack.us);
+  }
+  logged = true;
+}
+
+/* Switches fast-forward with the key combination and reports its speed */
+static void update_fast_forward(void) {
+  static uint32_t start_us;
+  static uint32_t start_frames;
+  bool held = (sdl_get_buttons() & FAST_FORWARD_BUTTONS) == FAST_FORWARD_BUTTONS &&
+              (sdl_get_directions() & FAST_FORWARD_DIRECTIONS) == FAST_FORWARD_DIRECTIONS;
+
+  if (held == pacer_get_fast_forward()) return;
+  pacer_set_fast_forward(held);
+  if (held) {
+    start_us = micros();
+    start_frames = pacer_get_frames();
+  } else {
+    uint32_t frames = pacer_get_frames() - start_frames;
+    printf("fast-forward: %.2fx for %u frames\n",
+           frames * 1e6f / (micros() - start_us) / PACER_FRAME_RATE, frames);
+  }
+}
 
 /* The setup is done here with initialisation of the display, the SD card, the CPU and the Emulator*/
 /* The setup includes the handling of the menu and the handling of loading games*/
@@ -23,27 +112,39 @@ void setup() {
   sd_init(); //SD card init
 
 /*Menu handling*/
-  char file_list[MAX_FILES][MAX_FILENAME_LEN];
-  int file_count = 0;
-  bool error = sd_list_files(file_list, &file_count);
-  if (!error) {  //Check if sd card is avaiable
+  // ROMs anywhere on the card, from the index kept at its root
+  int file_count = catalog_open("/sdcard");
+  if (file_count < 0) {  //Check if sd card is avaiable
     sd_card_missing();
     while (1) {}
   }
-  int selected_file_index = display_files_on_lcd(file_list, file_count);
-  char file_name[MAX_FILENAME_LEN];
-  strcpy(file_name, file_list[selected_file_index]);
+  if (file_count == 0) {  // Card is there, but holds no .gb or .gbz files
+    no_roms_found();
+    while (1) {}
+  }
+  int selected_file_index = display_files_on_lcd(file_count);
+  struct catalog_entry entry;
+  catalog_get(selected_file_index, &entry);
   clearScreen();
-  unsigned char *gb_rom = sd_read_file(file_name);  //Is a malloc and will never be freed
-  if (gb_rom != NULL) {
-    int r = rom_init(gb_rom);  // Process the ROM
+  const char *full_path = entry.path;
+#ifdef PERF_REPORT
+  rom_provider_bench(full_path);
+#endif
+  load_start_us = micros();
+#ifdef ROM_STREAM_BANKS
+  int r = rom_load_from(&rom_provider_stream, full_path);
+#else
+  // Flash partition if there is one, else PSRAM, else banks from the card
+  int r = rom_load(full_path);
+#endif
+  if (r) {
     printf("File loaded\n");
   } else {
     printf("Error reading the selected file.\n");
-    free(gb_rom); //Free malloc if init failed
   }
 
   gameboy_mem_init();
+  cart_ram_load(full_path);
 
   cpu_init();
 
@@ -51,18 +152,20 @@ void setup() {
   printf("CPU Freq = %u Mhz\n", cpu_freq);
   cpu_freq *= 1000000;
 
-  cycles_per_frame = cpu_freq / frames_per_sec;
-  cycles_in_micro_sec = cpu_freq / 1000000;
-  printf("cycles_per_frame %d cycles_in_micro_sec %d\n", cycles_per_frame,
-         cycles_in_micro_sec);
-}
-
-//#define PERF_REPORT
+#ifdef PERF_REPORT
+  pixel_selftest();
+  pixel_bench();
+#endif
 
-#define REPORT_INTERVAL 60
+  pacer_init(&pacer_cycle_clock);
+  runahead_init(RUN_AHEAD_FRAMES);
+}
 
 void loop() {
   bool screen_updated = false;
+  // Behind schedule frames are emulated without drawing
+  bool render = pacer_frame_begin();
+  runahead_begin(render);
 #ifdef PERF_REPORT
   uint32_t loop_start = ESP.getCycleCount();
   uint32_t adjust = 100;
@@ -90,64 +193,77 @@ void loop() {
   uint32_t start_bank_switches = mem_get_bank_switches();
   static uint32_t frame_cycles[REPORT_INTERVAL] = {};
   static int bank_switches[REPORT_INTERVAL] = {};
+  static uint32_t prev_presented = 0;
+  static uint32_t prev_dropped = 0;
+  static uint32_t prev_spi_bytes = 0;
+  static uint32_t prev_spi_us = 0;
+  static uint32_t prev_interlaced = 0;
+  static uint32_t prev_skipped = 0;
+  static uint32_t prev_frames = 0;
+  static uint32_t prev_report_us = micros();
+#ifdef LCD_LINE_MEMO
+  static int total_memo_hits = 0;
+#endif
 #endif
-  uint32_t start_frame_cycle = ESP.getCycleCount();
   uint32_t emulator_cpu_cycle = 0;
-  while (!screen_updated) {
+  do {
+    screen_updated = false;
+    while (!screen_updated) {
 #ifdef PERF_REPORT
-    auto pc = cpu_get_pc();
-    unsigned char opcode = mem_get_byte(pc);
+      auto pc = cpu_get_pc();
+      unsigned char opcode = mem_get_byte(pc);
 
-    uint32_t cpu_start = ESP.getCycleCount();
+      uint32_t cpu_start = ESP.getCycleCount();
 #endif
 
-    emulator_cpu_cycle = cpu_cycle();
+      emulator_cpu_cycle = cpu_cycle();
 
 #ifdef PERF_REPORT
-    uint32_t lcd_start = ESP.getCycleCount();
-    uint32_t cpu_end = lcd_start;
+      uint32_t lcd_start = ESP.getCycleCount();
+      uint32_t cpu_end = lcd_start;
 #endif
 
-    screen_updated = lcd_cycle(emulator_cpu_cycle);
+      screen_updated = lcd_cycle(emulator_cpu_cycle);
 
 #ifdef PERF_REPORT
-    uint32_t timer_start = ESP.getCycleCount();
-    uint32_t lcd_end = timer_start;
+      uint32_t timer_start = ESP.getCycleCount();
+      uint32_t lcd_end = timer_start;
 #endif
 
-    timer_cycle(emulator_cpu_cycle);
+      timer_cycle(emulator_cpu_cycle);
 
 #ifdef PERF_REPORT
-    uint32_t timer_end = ESP.getCycleCount();
+      uint32_t timer_end = ESP.getCycleCount();
 
-    total_cpu += cpu_end - cpu_start - adjust;
-    if (cpu_end - cpu_start - adjust > 1000000) {
-      printf("cpu timer seems incorrect:\n    end %u, start %u, adjust %u\n",
-             cpu_end, cpu_start, adjust);
-    }
-    total_lcd += lcd_end - lcd_start - adjust;
-    total_timer += timer_end - timer_start - adjust;
-    opcode_profile[opcode] += cpu_end - cpu_start - adjust;
+      total_cpu += cpu_end - cpu_start - adjust;
+      if (cpu_end - cpu_start - adjust > 1000000) {
+        printf("cpu timer seems incorrect:\n    end %u, start %u, adjust %u\n",
+               cpu_end, cpu_start, adjust);
+      }
+      total_lcd += lcd_end - lcd_start - adjust;
+      total_timer += timer_end - timer_start - adjust;
+      opcode_profile[opcode] += cpu_end - cpu_start - adjust;
 #endif
-  }
+    }
+  } while (runahead_next());
 
 #ifdef PERF_REPORT
   uint32_t sdl_start = ESP.getCycleCount();
 #endif
 
-  sdl_update();
+  if (render) sdl_update();
 
 #ifdef PERF_REPORT
   uint32_t sdl_end = ESP.getCycleCount();
   uint32_t delay_start = sdl_end;
 #endif
 
-  // delay next frame
-  uint32_t end_frame_cycle = ESP.getCycleCount();
-  uint32_t cycles_delta = end_frame_cycle - start_frame_cycle;
-  if (cycles_delta < cycles_per_frame) {
-    delayMicroseconds(cycles_delta / cycles_in_micro_sec);
-  }
+  update_fast_forward();
+  log_startup();
+  cart_ram_poll();
+
+  // Sleep until the next frame is due
+  pacer_frame_end();
 
 #ifdef PERF_REPORT
   uint32_t delay_end = ESP.getCycleCount();
@@ -160,6 +276,9 @@ void loop() {
       total_delay + total_timer + total_sdl + total_lcd + total_cpu;
   assert(frame_cycles[frames_count] < 1000000000);
   bank_switches[frames_count] = mem_get_bank_switches() - start_bank_switches;
+#ifdef LCD_LINE_MEMO
+  total_memo_hits += lcd_get_memo_hits();
+#endif
 
   frames_count += 1;
   sdl_count += 1;
@@ -201,6 +320,71 @@ void loop() {
     printf("min cycles per frame: %d\n", min_cycles_per_frame);
     printf("max cycles per frame: %d\n", max_cycles_per_frame);
     printf("bank switches: %d\n", total_bank_switches);
+    print_bank_heat();
+    struct bank_cache_stats banks;
+    bank_cache_read_stats(&banks);
+    if (banks.hits + banks.misses) {
+      printf("bank cache hits: %u, misses: %u, evictions: %u, worst switch: %u us\n",
+             banks.hits, banks.misses, banks.evictions, banks.worst_us);
+    }
+    uint32_t report_us = micros();
+    uint32_t spi_bytes = sdl_get_spi_bytes();
+    uint32_t spi_us = sdl_get_spi_us();
+    uint32_t interlaced = sdl_get_interlaced_frames();
+    printf("spi bytes/frame: %u, spi time/frame: %u us, interlaced: %u\n",
+           (spi_bytes - prev_spi_bytes) / frames_count,
+           (spi_us - prev_spi_us) / frames_count, interlaced - prev_interlaced);
+    prev_spi_bytes = spi_bytes;
+    prev_spi_us = spi_us;
+    prev_interlaced = interlaced;
+#ifdef SDL_STREAM_LINES
+    struct stream_stats stream;
+    stream_read_stats(&stream);
+    printf("bands sent: %u, dropped: %u\n", stream.bands, stream.dropped);
+    printf("band latency avg: %u us, max: %u us\n", stream.latency_avg,
+           stream.latency_max);
+#else
+    uint32_t presented = frame_queue_get_presented();
+    uint32_t dropped = frame_queue_get_dropped();
+    printf("frames presented: %u, dropped: %u, display fps: %.1f\n",
+           presented - prev_presented, dropped - prev_dropped,
+           (presented - prev_presented) * 1e6f / (report_us - prev_report_us));
+    prev_presented = presented;
+    prev_dropped = dropped;
+#endif
+    uint32_t paced = pacer_get_frames();
+    printf("speed: %.2fx\n", (paced - prev_frames) * 1e6f /
+                                 (report_us - prev_report_us) / PACER_FRAME_RATE);
+    prev_frames = paced;
+    prev_report_us = report_us;
+    struct runahead_stats ahead;
+    runahead_read_stats(&ahead);
+    if (ahead.frames) {
+      printf("run-ahead %d: snapshot %u us/frame, frames ahead %u us/frame\n",
+             runahead_get_frames(), ahead.snapshot_us / ahead.frames,
+             ahead.ahead_us / ahead.frames);
+    }
+    uint32_t skipped = pacer_get_skipped();
+    struct pacer_jitter jitter;
+    pacer_get_jitter(&jitter);
+    printf("frames skipped: %u (min %d, max %d in a row), resyncs: %u\n",
+           skipped - prev_skipped, FRAMESKIP_MIN, FRAMESKIP_MAX,
+           pacer_get_resyncs());
+    printf("frame jitter p50: %u us, p95: %u us, p99: %u us, max: %u us\n",
+           jitter.p50, jitter.p95, jitter.p99, jitter.max);
+#ifdef LCD_LINE_MEMO
+    // Skipped frames draw no lines, so they neither hit nor miss
+    int rendered = frames_count - (skipped - prev_skipped);
+    if (rendered) {
+      printf("line memo hit rate: %d%%\n",
+             total_memo_hits * 100 / (rendered * 144));
+    }
+    total_memo_hits = 0;
+#endif
+    prev_skipped = skipped;
+#ifdef LATENCY_PROBE
+    latency_print();  // Totals since boot
+#endif
 
     int longest_opcode = 0;
     int opcode_cycles = opcode_profile[0];
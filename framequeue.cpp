@@ -0,0 +1,113 @@
+#include "framequeue.h"
+
+#include <atomic>
+
+#ifdef BUILD_FOR_PC
+#include <condition_variable>
+#include <mutex>
+#else
+#include <Arduino.h>
+#endif
+
+/* The shared state word holds the slot between the two sides */
+#define SLOT_MASK 0x3
+#define FRESH 0x4  // Shared slot holds a frame that was not presented yet
+#define BUSY 0x8   // Presenter is drawing from the shared slot (two slots)
+
+static int num_slots;
+static std::atomic<uint32_t> state;
+static int back_slot;   // Owned by the emulator
+static int front_slot;  // Owned by the presenter (three slots)
+static std::atomic<uint32_t> presented;
+static std::atomic<uint32_t> dropped;
+
+#ifdef BUILD_FOR_PC
+// Never destroyed: the presenter thread may still be waiting at exit
+static std::mutex &wake_mutex = *new std::mutex;
+static std::condition_variable &wake = *new std::condition_variable;
+
+static void notify_presenter(void) {
+  std::lock_guard<std::mutex> lock(wake_mutex);
+  wake.notify_one();
+}
+
+static void wait_for_frame(void) {
+  std::unique_lock<std::mutex> lock(wake_mutex);
+  wake.wait(lock, [] { return (state & FRESH) != 0; });
+}
+#else
+static std::atomic<TaskHandle_t> presenter;
+
+static void notify_presenter(void) {
+  TaskHandle_t task = presenter;
+  if (task) xTaskNotifyGive(task);
+}
+
+static void wait_for_frame(void) {
+  // Registered before the state is checked again, so no wakeup is lost
+  if (!presenter) {
+    presenter = xTaskGetCurrentTaskHandle();
+    return;
+  }
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+#endif
+
+void frame_queue_init(int slots) {
+  num_slots = slots;
+  back_slot = 0;
+  front_slot = 2;
+  state = 1;
+  presented = 0;
+  dropped = 0;
+}
+
+int frame_queue_back(void) { return back_slot; }
+
+void frame_queue_publish(void) {
+  uint32_t old;
+
+  if (num_slots == 3) {
+    old = state.exchange(back_slot | FRESH);
+  } else {
+    old = state.load();
+    // The other slot is on screen, keep drawing into ours
+    if ((old & BUSY) || !state.compare_exchange_strong(old, back_slot | FRESH)) {
+      dropped++;
+      return;
+    }
+  }
+
+  // A frame that was never presented has been replaced
+  if (old & FRESH) dropped++;
+  back_slot = old & SLOT_MASK;
+
+  notify_presenter();
+}
+
+int frame_queue_acquire(void) {
+  while (true) {
+    uint32_t s = state.load();
+
+    if (s & FRESH) {
+      if (num_slots == 3) {
+        front_slot = state.exchange(front_slot) & SLOT_MASK;
+        return front_slot;
+      }
+      if (state.compare_exchange_strong(s, (s & SLOT_MASK) | BUSY))
+        return s & SLOT_MASK;
+      continue;
+    }
+
+    wait_for_frame();
+  }
+}
+
+void frame_queue_release(void) {
+  if (num_slots == 2) state &= ~BUSY;
+  presented++;
+}
+
+uint32_t frame_queue_get_presented(void) { return presented; }
+
+uint32_t frame_queue_get_dropped(void) { return dropped; }
@@ -0,0 +1,23 @@
+#ifndef FRAMEQUEUE_H
+#define FRAMEQUEUE_H
+#include <stdint.h>
+
+/*
+ * Single-producer/single-consumer handoff of frame buffer slots between the
+ * emulator and the draw task. The emulator never blocks; the presenter
+ * always gets the newest complete frame. With three slots a finished frame
+ * is only dropped when a newer one replaces it before it was presented,
+ * with two slots it is also dropped while the other slot is on screen.
+ */
+void frame_queue_init(int slots);
+// Slot the emulator is currently drawing into
+int frame_queue_back(void);
+// Hands the back slot to the presenter and moves on to a free one
+void frame_queue_publish(void);
+// Waits for a frame newer than the last one presented and returns its slot
+int frame_queue_acquire(void);
+// Presenter is done with the slot returned by frame_queue_acquire()
+void frame_queue_release(void);
+uint32_t frame_queue_get_presented(void);
+uint32_t frame_queue_get_dropped(void);
+#endif
@@ -6,6 +6,7 @@
 #include "interrupt.h"
 
 #include "cpu.h"
+#include "state.h"
 
 static int enabled;
 static int pending;
@@ -24,6 +25,24 @@ static unsigned int timer_masked = 1;
 static unsigned int serial_masked = 1;
 static unsigned int joypad_masked = 1;
 
+/* Saved for snapshots */
+#define INTERRUPT_STATE(X)                                                     \
+  X(enabled) X(pending) X(vblank) X(lcdstat) X(timer) X(serial) X(joypad)      \
+  X(vblank_masked) X(lcdstat_masked) X(timer_masked) X(serial_masked)          \
+  X(joypad_masked)
+
+size_t interrupt_state_size(void) { return 0 INTERRUPT_STATE(STATE_SIZE); }
+
+uint8_t *interrupt_save_state(uint8_t *p) {
+  INTERRUPT_STATE(STATE_SAVE)
+  return p;
+}
+
+const uint8_t *interrupt_load_state(const uint8_t *p) {
+  INTERRUPT_STATE(STATE_LOAD)
+  return p;
+}
+
 /* Returns true if the cpu should be unhalted */
 int interrupt_flush(void) {
   /* Flush the highest priority interrupt and/or resume the cpu */
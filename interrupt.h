@@ -1,5 +1,8 @@
 #ifndef INTERRUPT_H
 #define INTERRUPT_H
+#include <stddef.h>
+#include <stdint.h>
+
 
 void interrupt(unsigned int);
 void interrupt_disable(void);
@@ -10,6 +13,9 @@ unsigned char interrupt_get_mask(void);
 void interrupt_set_mask(unsigned char);
 int interrupt_pending(void);
 int interrupt_flush(void);
+size_t interrupt_state_size(void);
+uint8_t *interrupt_save_state(uint8_t *p);
+const uint8_t *interrupt_load_state(const uint8_t *p);
 
 enum {
   INTR_VBLANK = 0x01,
@@ -0,0 +1,168 @@
+#include "latency.h"
+
+#include <stdio.h>
+#include <atomic>
+
+#ifdef BUILD_FOR_PC
+#include <chrono>
+#define IRAM_ATTR
+#else
+#include <Arduino.h>
+#endif
+
+#define GAMEBOY_HEIGHT 144
+
+// A press not followed through in this time was lost, e.g. released before
+// the guest read the joypad
+#define STALE_US 1000000
+
+// Where the press being followed is. Each step has one owner: the button
+// interrupt leaves IDLE, the emulator moves it through READ to FRAME and the
+// display side finishes it.
+enum { IDLE, EDGE, READ, FRAME, PRESENTING };
+static std::atomic<int> stage;
+
+static unsigned int event_buttons;
+static uint32_t edge_us, read_us, frame_us;
+static uint32_t target_frame;  // First frame showing the change
+// Frames up to this id are on the display in full, ahead of target_frame
+// when the display side is done before the emulator finishes the frame
+static std::atomic<uint32_t> presented_frames;
+
+// Emulator side: line hashes of the last rendered frame
+static uint32_t line_hash[GAMEBOY_HEIGHT];
+static bool frame_changed;  // A line differed since the read
+static uint32_t frame_id;
+
+static std::atomic<uint32_t> abandoned;
+
+struct histogram {
+  std::atomic<uint32_t> count, sum_us, max_us;
+  std::atomic<uint32_t> buckets[LATENCY_BUCKETS];
+};
+static struct histogram histograms[LATENCY_STAGES];
+
+static const char *const stage_names[LATENCY_STAGES] = { "edge->read", "read->frame", "frame->spi", "total" };
+
+static IRAM_ATTR uint32_t now_us(void) {
+#ifdef BUILD_FOR_PC
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return micros();
+#endif
+}
+
+static void record(int s, uint32_t us) {
+  struct histogram *h = &histograms[s];
+  int bucket = us / 1000 < LATENCY_BUCKETS ? us / 1000 : LATENCY_BUCKETS - 1;
+
+  h->count++;
+  h->sum_us += us;
+  h->buckets[bucket]++;
+  uint32_t max = h->max_us;
+  while (us > max && !h->max_us.compare_exchange_weak(max, us)) {
+  }
+}
+
+// Records the press once its frame is on the display
+static void finish(void) {
+  int s = FRAME;
+  if (!stage.compare_exchange_strong(s, PRESENTING)) return;
+
+  uint32_t now = now_us();
+  record(LATENCY_EDGE_TO_READ, read_us - edge_us);
+  record(LATENCY_READ_TO_FRAME, frame_us - read_us);
+  record(LATENCY_FRAME_TO_SPI, now - frame_us);
+  record(LATENCY_TOTAL, now - edge_us);
+  stage.store(IDLE, std::memory_order_release);
+}
+
+void IRAM_ATTR latency_edge(unsigned int pressed) {
+  if (stage.load(std::memory_order_relaxed) != IDLE) return;
+  event_buttons = pressed;
+  edge_us = now_us();
+  stage.store(EDGE, std::memory_order_release);
+}
+
+void latency_read(unsigned int visible) {
+  if (stage.load(std::memory_order_acquire) != EDGE || !(visible & event_buttons)) return;
+  read_us = now_us();
+  frame_changed = false;
+  stage.store(READ, std::memory_order_relaxed);
+}
+
+void latency_line(int line, const void *px, int bytes) {
+  // FNV-1a
+  const uint8_t *p = (const uint8_t *)px;
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < bytes; i++) h = (h ^ p[i]) * 16777619u;
+
+  if (h != line_hash[line]) {
+    line_hash[line] = h;
+    frame_changed = true;
+  }
+}
+
+void latency_frame_done(void) {
+  int s = stage.load(std::memory_order_relaxed);
+  uint32_t now = now_us();
+
+  if (s == READ && frame_changed) {
+    frame_us = now;
+    target_frame = frame_id;
+    stage.store(FRAME, std::memory_order_release);
+    if ((int32_t)(presented_frames - target_frame) > 0) finish();
+  } else if (s != IDLE && s != PRESENTING && now - edge_us > STALE_US) {
+    if (stage.compare_exchange_strong(s, IDLE)) abandoned++;
+  }
+  frame_changed = false;
+  frame_id++;
+}
+
+uint32_t latency_frame_id(void) { return frame_id; }
+
+void latency_presented(uint32_t frame) {
+  uint32_t n = presented_frames;
+  while ((int32_t)(frame + 1 - n) > 0 && !presented_frames.compare_exchange_weak(n, frame + 1)) {
+  }
+  if (stage.load(std::memory_order_acquire) == FRAME && (int32_t)(frame - target_frame) >= 0) finish();
+}
+
+void latency_get_stage(int s, struct latency_stage *out) {
+  struct histogram *h = &histograms[s];
+
+  out->count = h->count;
+  out->avg_us = out->count ? h->sum_us / out->count : 0;
+  out->max_us = h->max_us;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) out->buckets[i] = h->buckets[i];
+}
+
+// Upper bound in milliseconds of the bucket holding the given percentile
+static int percentile_ms(const struct latency_stage *st, int percent) {
+  uint32_t seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += st->buckets[i];
+    if (seen * 100 >= st->count * percent) return i + 1;
+  }
+  return LATENCY_BUCKETS;
+}
+
+void latency_print(void) {
+  for (int s = 0; s < LATENCY_STAGES; s++) {
+    struct latency_stage st;
+    latency_get_stage(s, &st);
+    if (!st.count) continue;
+
+    printf("latency %-11s n=%u avg %.1f ms, p50 <%d ms, p95 <%d ms, max %.1f ms\n", stage_names[s],
+           st.count, st.avg_us / 1000.0, percentile_ms(&st, 50), percentile_ms(&st, 95),
+           st.max_us / 1000.0);
+    printf("   ms:count");
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      if (st.buckets[i]) printf(" %d:%u", i, st.buckets[i]);
+    }
+    printf("\n");
+  }
+  if (abandoned) printf("latency: %u presses lost before they were seen\n", (unsigned)abandoned);
+}
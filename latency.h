@@ -0,0 +1,50 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+#include <stdint.h>
+
+/*
+ * Input-to-photon latency probe. A button press is followed through four
+ * timestamps: the GPIO edge, the first guest read of 0xFF00 that sees it,
+ * the end of the first rendered frame after that read whose pixels differ
+ * from the frame before, and the end of the display transfer of that frame.
+ * One press is followed at a time; presses while one is in flight are not
+ * measured. A scene that moves by itself changes every frame, so measure on
+ * a still screen such as a menu.
+ */
+
+// Build the probe in, and report it with PERF_REPORT
+//#define LATENCY_PROBE
+
+// Histogram buckets of 1 ms, the last one also counts everything above
+#define LATENCY_BUCKETS 64
+
+enum {
+  LATENCY_EDGE_TO_READ,
+  LATENCY_READ_TO_FRAME,
+  LATENCY_FRAME_TO_SPI,
+  LATENCY_TOTAL,
+  LATENCY_STAGES
+};
+
+struct latency_stage {
+  uint32_t count;
+  uint32_t avg_us, max_us;
+  uint32_t buckets[LATENCY_BUCKETS];
+};
+
+// Buttons in pressed, laid out as in sdl_take_joypad_presses(), went down
+void latency_edge(unsigned int pressed);
+// The guest read 0xFF00 and saw the buttons in visible
+void latency_read(unsigned int visible);
+// A native line was rendered into the frame buffer
+void latency_line(int line, const void *px, int bytes);
+// The emulator finished rendering a frame
+void latency_frame_done(void);
+// Number of frames finished so far, also the id of the frame being rendered
+uint32_t latency_frame_id(void);
+// Frame id has been sent to the display in full
+void latency_presented(uint32_t frame);
+void latency_get_stage(int stage, struct latency_stage *out);
+// Prints every stage with its histogram and presses not followed through
+void latency_print(void);
+#endif
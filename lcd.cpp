@@ -1,9 +1,17 @@
 #include "lcd.h"
+#include <stdlib.h>
+#include <string.h>
+#ifndef BUILD_FOR_PC
 #include <Arduino.h>
+#endif
 #include "cpu.h"
 #include "interrupt.h"
+#include "latency.h"
 #include "mem.h"
+#include "pixel.h"
 #include "sdl.h"
+#include "state.h"
+#include "stream.h"
 
 // LCD-related state variables and configurations
 
@@ -17,6 +25,13 @@ static int mode1_vblank_int;     // Mode 1 (VBlank) interrupt enable
 static int mode0_hblank_int;     // Mode 0 (HBlank) interrupt enable
 static int ly_int_flag;          // LYC interrupt flag
 static int lcd_mode;             // Current LCD mode
+static int render_enabled = 1;   // Lines are drawn into the frame buffer
+
+/* LCD timing, in CPU cycles */
+static int this_frame_cycles;    // Into the current frame
+static unsigned int prev_cycles; // CPU cycle count at the last lcd_cycle()
+static int sub_line;             // Into the current line
+static int prev_update_cycles;   // this_frame_cycles at the last line update
 
 /* LCD Control flags */
 static int lcd_enabled;          // LCD enable flag
@@ -31,9 +46,33 @@ static int scroll_x, scroll_y;   // Background scroll positions
 static int window_x, window_y;   // Window positions
 
 /* Palette data */
-static byte bgpalette[] = {3, 2, 1, 0};  // Background color palette
-static byte sprpalette1[] = {0, 1, 2, 3}; // Sprite palette 1
-static byte sprpalette2[] = {0, 1, 2, 3}; // Sprite palette 2
+static uint8_t bgpalette[] = {3, 2, 1, 0};  // Background color palette
+static uint8_t sprpalette1[] = {0, 1, 2, 3}; // Sprite palette 1
+static uint8_t sprpalette2[] = {0, 1, 2, 3}; // Sprite palette 2
+
+/* Framebuffer pixel for each colour number, rebuilt when a palette changes */
+static pixel_t bg_lut[4], spr_lut1[4], spr_lut2[4];
+static int lut_dirty = 1;
+
+#ifdef LCD_BG_PLANE_CACHE
+/* Background planes: both tilemaps pre-rendered as 256x256 raw colour
+ * numbers (0-3). A set bit in plane_dirty marks a stale 8x8 block. */
+static uint8_t *bg_plane[2];
+static uint32_t plane_dirty[2][32];
+static int plane_alloc_failed;      // No memory for a plane, draw directly
+static uint8_t tile_dirty[384];     // Tile data blocks written since last flush
+static int tiledata_dirty_pending;
+#endif
+
+#ifdef LCD_LINE_MEMO
+/* Line memoisation: signature each line was last rendered with, per frame
+ * buffer since every buffer still holds the frame it was last given */
+static uint32_t line_sig[FRAME_BUFFERS][144];
+static uint8_t line_sig_valid[FRAME_BUFFERS][144];
+static uint16_t tile_gen[384];   // Bumped on every change to a tile's data
+static int memo_hits;            // Lines skipped so far in this frame
+static int memo_hits_last;       // Lines skipped in the last full frame
+#endif
 
 // Sprite attributes
 struct sprite {
@@ -42,6 +81,38 @@ struct sprite {
 
 enum { PRIO = 0x80, VFLIP = 0x40, HFLIP = 0x20, PNUM = 0x10 }; // Sprite flags
 
+// Saved for snapshots; render_enabled belongs to the frame pacing instead
+#define LCD_STATE(X)                                                           \
+    X(lcd_line) X(lcd_ly_compare) X(ly_int) X(mode2_oam_int)                   \
+    X(mode1_vblank_int) X(mode0_hblank_int) X(ly_int_flag) X(lcd_mode)         \
+    X(lcd_enabled) X(window_tilemap_select) X(window_enabled)                  \
+    X(tilemap_select) X(bg_tiledata_select) X(sprite_size) X(sprites_enabled)  \
+    X(bg_enabled) X(scroll_x) X(scroll_y) X(window_x) X(window_y)              \
+    X(bgpalette) X(sprpalette1) X(sprpalette2) X(this_frame_cycles)            \
+    X(prev_cycles) X(sub_line) X(prev_update_cycles)
+
+size_t lcd_state_size(void) {
+    return 0 LCD_STATE(STATE_SIZE);
+}
+
+uint8_t *lcd_save_state(uint8_t *p) {
+    LCD_STATE(STATE_SAVE)
+    return p;
+}
+
+const uint8_t *lcd_load_state(const uint8_t *p) {
+#ifdef LCD_BG_PLANE_CACHE
+    int tiledata_select = bg_tiledata_select;
+#endif
+    LCD_STATE(STATE_LOAD)
+    lut_dirty = 1;
+#ifdef LCD_BG_PLANE_CACHE
+    // As lcd_write_control(), the planes hold the other tile data
+    if (bg_tiledata_select != tiledata_select) memset(plane_dirty, 0xFF, sizeof(plane_dirty));
+#endif
+    return p;
+}
+
 // Returns the current LCD STAT register value
 unsigned char lcd_get_stat(void) { 
     return (ly_int << 6) | lcd_mode; 
@@ -53,6 +124,7 @@ void lcd_write_bg_palette(unsigned char n) {
     bgpalette[1] = (n >> 2) & 3;
     bgpalette[2] = (n >> 4) & 3;
     bgpalette[3] = (n >> 6) & 3;
+    lut_dirty = 1;
 }
 
 // Writes a value to sprite palette 1
@@ -61,6 +133,7 @@ void lcd_write_spr_palette1(unsigned char n) {
     sprpalette1[1] = (n >> 2) & 3;
     sprpalette1[2] = (n >> 4) & 3;
     sprpalette1[3] = (n >> 6) & 3;
+    lut_dirty = 1;
 }
 
 // Writes a value to sprite palette 2
@@ -69,6 +142,7 @@ void lcd_write_spr_palette2(unsigned char n) {
     sprpalette2[1] = (n >> 2) & 3;
     sprpalette2[2] = (n >> 4) & 3;
     sprpalette2[3] = (n >> 6) & 3;
+    lut_dirty = 1;
 }
 
 // Sets the X scroll position for the background
@@ -81,6 +155,11 @@ void lcd_write_scroll_y(unsigned char n) {
     scroll_y = n; 
 }
 
+// Turns drawing of lines on or off for frameskip
+void lcd_set_render_enabled(bool enabled) {
+    render_enabled = enabled;
+}
+
 // Returns the current LCD line
 int lcd_get_line(void) { 
     return lcd_line; 
@@ -93,6 +172,10 @@ void lcd_write_stat(unsigned char c) {
 
 // Updates the LCD control register
 void lcd_write_control(unsigned char c) {
+#ifdef LCD_BG_PLANE_CACHE
+    // Every map entry now resolves to a different tile data block
+    if (bg_tiledata_select != !!(c & 0x10)) memset(plane_dirty, 0xFF, sizeof(plane_dirty));
+#endif
     bg_enabled = !!(c & 0x01);
     sprites_enabled = !!(c & 0x02);
     sprite_size = !!(c & 0x04);
@@ -145,10 +228,154 @@ static void sort_sprites(struct sprite *s, int n) {
 #define TARGET_HEIGHT 216
 #define TARGET_WIDTH 240
 
+// Rebuilds the colour number to framebuffer pixel lookup tables
+static void rebuild_luts(void) {
+#ifdef FRAMEBUFFER_RGB565
+    const uint16_t *colors = sdl_get_palette();
+    pixel_t shades[4];
+    for (int i = 0; i < 4; i++) {
+        // Byte-swapped so the buffer is already in display order
+        shades[i] = (colors[i] >> 8) | (colors[i] << 8);
+    }
+#else
+    const pixel_t shades[4] = {0, 1, 2, 3};
+#endif
+    for (int i = 0; i < 4; i++) {
+        bg_lut[i] = shades[bgpalette[i]];
+        spr_lut1[i] = shades[sprpalette1[i]];
+        spr_lut2[i] = shades[sprpalette2[i]];
+    }
+    lut_dirty = 0;
+}
+
+// Scales one native line into the 3:2 target framebuffer
+static void output_line(pixel_t *frame_buffer, int line, const pixel_t *px) {
+#ifdef FRAMEBUFFER_2BPP
+    // Kept at native resolution, four pixels per byte
+    pixel_t *row = &frame_buffer[line * (GAMEBOY_WIDTH / 4)];
+    for (int x = 0; x < GAMEBOY_WIDTH; x += 4) {
+        *row++ = px[x] << 6 | px[x + 1] << 4 | px[x + 2] << 2 | px[x + 3];
+    }
+#else
+    pixel_t *row = &frame_buffer[line * 3 / 2 * TARGET_WIDTH];
+#ifdef FRAMEBUFFER_RGB565
+    pixel_scale_3_2_16(px, row, GAMEBOY_WIDTH);
+#else
+    pixel_scale_3_2_8(px, row, GAMEBOY_WIDTH);
+#endif
+    // Odd lines cover two target rows
+    if (line & 1) memcpy(row + TARGET_WIDTH, row, TARGET_WIDTH * sizeof(pixel_t));
+#endif
+}
+
+#ifdef LCD_TRACK_VRAM
+// Tile data block (0-383) used by a tilemap entry
+static unsigned int tile_index(unsigned int tile_num) {
+    return bg_tiledata_select ? tile_num : 256 + (signed char)tile_num;
+}
+
+// Tracks VRAM writes that invalidate cached rendering state
+void lcd_write_vram(unsigned short addr, unsigned char n) {
+    const unsigned char *raw_mem = mem_get_raw();
+
+    if (raw_mem[addr] == n) return;
+
+    if (addr < 0x9800) {
+#ifdef LCD_LINE_MEMO
+        tile_gen[(addr - 0x8000) >> 4]++;
+#endif
+#ifdef LCD_BG_PLANE_CACHE
+        tile_dirty[(addr - 0x8000) >> 4] = 1;
+        tiledata_dirty_pending = 1;
+#endif
+    } else {
+#ifdef LCD_BG_PLANE_CACHE
+        unsigned int map = (addr - 0x9800) >> 10;
+        unsigned int offset = addr & 0x3FF;
+        plane_dirty[map][offset >> 5] |= 1u << (offset & 31);
+#endif
+    }
+}
+#endif
+
+#ifdef LCD_BG_PLANE_CACHE
+// Allocates a plane, preferring PSRAM on the device
+static uint8_t *alloc_plane(void) {
+#ifdef BUILD_FOR_PC
+    return (uint8_t *)malloc(256 * 256);
+#else
+    uint8_t *p = (uint8_t *)heap_caps_malloc(256 * 256, MALLOC_CAP_SPIRAM);
+    return p ? p : (uint8_t *)malloc(256 * 256);
+#endif
+}
+
+// Marks every map entry that references a modified tile as stale
+static void flush_tiledata_dirty(const unsigned char *raw_mem) {
+    for (int map = 0; map < 2; map++) {
+        const unsigned char *tilemap = &raw_mem[0x9800 + map * 0x400];
+        for (int i = 0; i < 0x400; i++) {
+            if (tile_dirty[tile_index(tilemap[i])])
+                plane_dirty[map][i >> 5] |= 1u << (i & 31);
+        }
+    }
+    memset(tile_dirty, 0, sizeof(tile_dirty));
+    tiledata_dirty_pending = 0;
+}
+
+// Re-renders one 8x8 block of a plane from its tile data
+static void render_plane_tile(int map, int tx, int ty, const unsigned char *raw_mem) {
+    unsigned int tile_num = raw_mem[0x9800 + map * 0x400 + ty * 32 + tx];
+    const unsigned char *tile = &raw_mem[0x8000 + tile_index(tile_num) * 16];
+    uint8_t *dst = &bg_plane[map][(ty * 8) * 256 + tx * 8];
+
+    for (int y = 0; y < 8; y++) {
+        unsigned char b1 = tile[y * 2];
+        unsigned char b2 = tile[y * 2 + 1];
+        for (int x = 0; x < 8; x++) {
+            unsigned char mask = 128 >> x;
+            dst[x] = (!!(b2 & mask) << 1) | !!(b1 & mask);
+        }
+        dst += 256;
+    }
+}
+
+// Copies a wrapped 160-pixel span of a plane row, refreshing stale blocks
+// first. Returns 0 if the plane could not be allocated.
+static int draw_plane_line(pixel_t *px, int map, unsigned int xm, unsigned int ym, const unsigned char *raw_mem) {
+    if (!bg_plane[map]) {
+        if (plane_alloc_failed) return 0;
+        bg_plane[map] = alloc_plane();
+        if (!bg_plane[map]) {
+            plane_alloc_failed = 1;
+            return 0;
+        }
+        memset(plane_dirty[map], 0xFF, sizeof(plane_dirty[map]));
+    }
+    if (tiledata_dirty_pending) flush_tiledata_dirty(raw_mem);
+
+    int ty = ym / 8;
+    uint32_t dirty = plane_dirty[map][ty];
+    if (dirty) {
+        // 21 blocks cover a 160-pixel span at any alignment
+        for (int i = 0; i < 21; i++) {
+            int tx = (xm / 8 + i) & 31;
+            if (dirty & (1u << tx)) render_plane_tile(map, tx, ty, raw_mem);
+            dirty &= ~(1u << tx);
+        }
+        plane_dirty[map][ty] = dirty;
+    }
+
+    const uint8_t *row = &bg_plane[map][ym * 256];
+    for (int x = 0; x < GAMEBOY_WIDTH; ++x) {
+        px[x] = bg_lut[row[(xm + x) & 255]];
+    }
+    return 1;
+}
+#endif
+
 // Draws the background and window layers
-static void draw_bg_and_window(uint8_t *frame_buffer, int line, const unsigned char *raw_mem) {
-    unsigned int map_select, map_offset, tile_num, tile_addr, xm, ym;
-    unsigned char b1, b2, mask, colour;
+static void draw_bg_and_window(pixel_t *px, int line, const unsigned char *raw_mem) {
+    unsigned int map_select, xm, ym;
 
     // Determine if we're drawing the window or background
     if (window_enabled && line >= window_y && (line - window_y) < GAMEBOY_HEIGHT) {
@@ -158,9 +385,7 @@ static void draw_bg_and_window(uint8_t *frame_buffer, int line, const unsigned c
     } else {
         if (!bg_enabled) {
             // Fill the line with the background color if the background is disabled
-            for (int x = 0; x < TARGET_WIDTH; ++x) {
-                frame_buffer[line * TARGET_WIDTH + x] = bgpalette[0];
-            }
+            for (int x = 0; x < GAMEBOY_WIDTH; ++x) px[x] = bg_lut[0];
             return;
         }
         xm = scroll_x % 256;
@@ -168,7 +393,12 @@ static void draw_bg_and_window(uint8_t *frame_buffer, int line, const unsigned c
         map_select = tilemap_select;
     }
 
-    // Scale and render the background pixels
+#ifdef LCD_BG_PLANE_CACHE
+    if (draw_plane_line(px, map_select, xm, ym, raw_mem)) return;
+#endif
+    unsigned int map_offset, tile_num, tile_addr;
+    unsigned char b1, b2, mask, colour;
+
     for (int x = 0; x < GAMEBOY_WIDTH; ++x) {
         map_offset = (ym / 8) * 32 + xm / 8;
         tile_num = raw_mem[0x9800 + map_select * 0x400 + map_offset];
@@ -179,31 +409,18 @@ static void draw_bg_and_window(uint8_t *frame_buffer, int line, const unsigned c
         mask = 128 >> (xm % 8);
         colour = (!!(b2 & mask) << 1) | !!(b1 & mask);
 
-        int scaledXStart = x * 3 / 2; 
-        int scaledXEnd = (x + 1) * 3 / 2; 
-        int scaledLineStart = line * 3 / 2; 
-        int scaledLineEnd = (line + 1) * 3 / 2;
-
-        // Fill the scaled region in the framebuffer
-        for (int sy = scaledLineStart; sy < scaledLineEnd; ++sy) {
-            for (int sx = scaledXStart; sx < scaledXEnd; ++sx) {
-                int bufferIndex = sy * TARGET_WIDTH + sx;
-                if (bufferIndex >= 0 && bufferIndex < TARGET_WIDTH * TARGET_HEIGHT) {
-                    frame_buffer[bufferIndex] = bgpalette[colour];
-                }
-            }
-        }
+        px[x] = bg_lut[colour];
 
         xm = (xm + 1) % 256;
     }
 }
 
 // Draws the sprites on the given line
-static void draw_sprites(uint8_t *frame_buffer, int line, int nsprites, struct sprite *s, const unsigned char *raw_mem) {
+static void draw_sprites(pixel_t *px, int line, int nsprites, struct sprite *s, const unsigned char *raw_mem) {
     int i;
 
     for (i = 0; i < nsprites; i++) {
-        unsigned int b1, b2, tile_addr, sprite_line, x;
+        unsigned int b1, b2, tile_addr, sprite_line;
 
         if (s[i].x < -7 || s[i].x >= GAMEBOY_WIDTH) continue; // Sprite is outside the screen
 
@@ -214,9 +431,9 @@ static void draw_sprites(uint8_t *frame_buffer, int line, int nsprites, struct s
         b1 = raw_mem[tile_addr];
         b2 = raw_mem[tile_addr + 1];
 
-        for (x = 0; x < 8; x++) {
+        for (int x = 0; x < 8; x++) {
             unsigned char mask, colour;
-            byte *pal;
+            const pixel_t *pal;
 
             if ((s[i].x + x) < 0 || (s[i].x + x) >= GAMEBOY_WIDTH) continue;
 
@@ -224,34 +441,72 @@ static void draw_sprites(uint8_t *frame_buffer, int line, int nsprites, struct s
             colour = ((!!(b2 & mask)) << 1) | !!(b1 & mask);
             if (colour == 0) continue;
 
-            pal = (s[i].flags & PNUM) ? sprpalette2 : sprpalette1;
-
-            int scaledXStart = (s[i].x + x) * 3 / 2;
-            int scaledXEnd = (s[i].x + x + 1) * 3 / 2;
-            int scaledLineStart = line * 3 / 2;
-            int scaledLineEnd = (line + 1) * 3 / 2;
-
-            // Setze den Bereich des Pixels im Framebuffer
-            for (int sy = scaledLineStart; sy < scaledLineEnd; ++sy) {
-                for (int sx = scaledXStart; sx < scaledXEnd; ++sx) {
-                    int bufferIndex = sy * TARGET_WIDTH + sx;
-                    if (bufferIndex >= 0 && bufferIndex < TARGET_WIDTH * TARGET_HEIGHT) {
-                        frame_buffer[bufferIndex] = pal[colour];
-                    }
-                }
-            }
+            pal = (s[i].flags & PNUM) ? spr_lut2 : spr_lut1;
+
+            px[s[i].x + x] = pal[colour];
         }
     }
 }
 
+#ifdef LCD_LINE_MEMO
+#define SIG_MIX(h, v) ((h) = ((h) ^ (uint32_t)(v)) * 16777619u)
+
+// Hashes everything render_line() reads for this line
+static uint32_t line_signature(int line, int nsprites, struct sprite *s, const unsigned char *raw_mem) {
+    uint32_t h = 2166136261u;
+
+    SIG_MIX(h, bg_enabled | sprite_size << 1 | window_enabled << 2 | bg_tiledata_select << 3);
+    SIG_MIX(h, bgpalette[0] | bgpalette[1] << 2 | bgpalette[2] << 4 | bgpalette[3] << 6);
+    SIG_MIX(h, sprpalette1[1] | sprpalette1[2] << 2 | sprpalette1[3] << 4 |
+               sprpalette2[1] << 6 | sprpalette2[2] << 8 | sprpalette2[3] << 10);
+
+    // Background or window row, the same selection draw_bg_and_window() makes
+    unsigned int map_select, xm, ym;
+    if (window_enabled && line >= window_y && (line - window_y) < GAMEBOY_HEIGHT) {
+        xm = 0;
+        ym = line - window_y;
+        map_select = window_tilemap_select;
+    } else if (bg_enabled) {
+        xm = scroll_x % 256;
+        ym = (line + scroll_y) % 256;
+        map_select = tilemap_select;
+    } else {
+        xm = ym = map_select = 0x100;
+    }
+    SIG_MIX(h, xm | ym << 9 | map_select << 18);
 
-// Renders a single line of the LCD display
-static void render_line(int line) {
+    if (map_select != 0x100) {
+        const unsigned char *row = &raw_mem[0x9800 + map_select * 0x400 + (ym / 8) * 32];
+        for (int i = 0; i < 21; i++) {
+            unsigned int tile_num = row[(xm / 8 + i) & 31];
+            SIG_MIX(h, tile_num | tile_gen[tile_index(tile_num)] << 8);
+        }
+    }
+
+    for (int i = 0; i < nsprites; i++) {
+        SIG_MIX(h, (s[i].y & 0xFF) | (s[i].x & 0xFF) << 8 | s[i].tile << 16 | s[i].flags << 24);
+        SIG_MIX(h, tile_gen[s[i].tile] | tile_gen[s[i].tile + 1] << 16);
+    }
+
+    return h;
+}
+
+const uint32_t *lcd_get_line_signatures(void) {
+    return line_sig[sdl_get_framebuffer_index()];
+}
+
+int lcd_get_memo_hits(void) {
+    return memo_hits_last;
+}
+#endif
+
+// Renders a single line of the LCD display, returns false if it was memoised
+static bool render_line(int line) {
     const unsigned char *raw_mem = mem_get_raw();
     int i, c = 0;
 
     struct sprite s[10];
-    uint8_t *buffer = sdl_get_framebuffer();
+    alignas(4) pixel_t px[GAMEBOY_WIDTH];
 
     for (i = 0; i < 40; i++) {
         int y = raw_mem[0xFE00 + (i * 4)] - 16;
@@ -268,10 +523,31 @@ static void render_line(int line) {
 
     if (c) sort_sprites(s, c);
 
+#ifdef LCD_LINE_MEMO
+    // The framebuffer still holds this line if nothing it depends on changed
+    int slot = sdl_get_framebuffer_index();
+    uint32_t sig = line_signature(line, c, s, raw_mem);
+    if (line_sig_valid[slot][line] && line_sig[slot][line] == sig) {
+        memo_hits++;
+        return false;
+    }
+    line_sig[slot][line] = sig;
+    line_sig_valid[slot][line] = 1;
+#endif
+
+    if (lut_dirty) rebuild_luts();
+
     /* Draw the background layer */
-    draw_bg_and_window(buffer, line, raw_mem);
+    draw_bg_and_window(px, line, raw_mem);
 
-    draw_sprites(buffer, line, c, s, raw_mem);
+    draw_sprites(px, line, c, s, raw_mem);
+
+#ifdef LATENCY_PROBE
+    latency_line(line, px, sizeof(px));
+#endif
+
+    output_line(sdl_get_framebuffer(), line, px);
+    return true;
 }
 
 // Handles LCD timing and rendering cycles
@@ -279,11 +555,6 @@ static void render_line(int line) {
 #define CYCLES_PER_LINE (456 / 4)
 
 bool lcd_cycle(unsigned int cycles) {
-    static int this_frame_cycles = 0;
-    static unsigned int prev_cycles = 0;
-    static int sub_line = 0;
-    static int prev_update_cycles = 0;
-
     this_frame_cycles += cycles - prev_cycles;
     prev_cycles = cycles;
 
@@ -310,7 +581,16 @@ bool lcd_cycle(unsigned int cycles) {
     if (sub_line >= CYCLES_PER_LINE) {
         sub_line -= CYCLES_PER_LINE;
 
-        if (lcd_line < GAMEBOY_HEIGHT) render_line(lcd_line);
+        // Between instructions, so a button press can interrupt safely
+        mem_joypad_poll();
+
+        if (lcd_line < GAMEBOY_HEIGHT && render_enabled) {
+#ifdef SDL_STREAM_LINES
+            stream_line_done(lcd_line, render_line(lcd_line));
+#else
+            render_line(lcd_line);
+#endif
+        }
 
         lcd_line += 1;
 
@@ -319,6 +599,13 @@ bool lcd_cycle(unsigned int cycles) {
         if (ly_int && lcd_line == lcd_ly_compare) interrupt(INTR_LCDSTAT);
 
         if (lcd_line == GAMEBOY_HEIGHT) {
+#ifdef LCD_LINE_MEMO
+            memo_hits_last = memo_hits;
+            memo_hits = 0;
+#endif
+#ifdef LATENCY_PROBE
+            if (render_enabled) latency_frame_done();
+#endif
             interrupt(INTR_VBLANK);
             return true;
         }
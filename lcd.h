@@ -1,8 +1,26 @@
 #ifndef LCD_H
 #define LCD_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Keep both tilemaps pre-rendered as 256x256 planes and copy each background
+// line out of them. Only tiles touched by VRAM writes are re-rendered.
+//#define LCD_BG_PLANE_CACHE
+
+// Skip rendering lines whose inputs (registers, palettes, tilemap row,
+// referenced tiles and sprites) hashed the same as in the previous frame.
+//#define LCD_LINE_MEMO
+
+#if defined(LCD_BG_PLANE_CACHE) || defined(LCD_LINE_MEMO)
+#define LCD_TRACK_VRAM
+#endif
+
 // returns true if frame updated
 // otherwise return false
 bool lcd_cycle(unsigned int cycles);
+// While disabled, frames keep their exact timing and interrupts but no lines
+// are drawn into the frame buffer (frameskip)
+void lcd_set_render_enabled(bool enabled);
 int lcd_get_line(void);
 unsigned char lcd_get_stat();
 void lcd_write_control(unsigned char);
@@ -15,4 +33,16 @@ void lcd_write_spr_palette2(unsigned char);
 void lcd_set_window_y(unsigned char);
 void lcd_set_window_x(unsigned char);
 void lcd_set_ly_compare(unsigned char);
+size_t lcd_state_size(void);
+uint8_t *lcd_save_state(uint8_t *p);
+const uint8_t *lcd_load_state(const uint8_t *p);
+#ifdef LCD_TRACK_VRAM
+void lcd_write_vram(unsigned short, unsigned char);
+#endif
+#ifdef LCD_LINE_MEMO
+// Input signatures of the 144 lines held by the current frame buffer
+const uint32_t *lcd_get_line_signatures(void);
+// Number of lines skipped in the last completed frame
+int lcd_get_memo_hits(void);
+#endif
 #endif
@@ -0,0 +1,232 @@
+#include "loader.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+#ifdef BUILD_FOR_PC
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#else
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "esp_heap_caps.h"
+#endif
+
+static uint32_t now_us(void) {
+#ifdef BUILD_FOR_PC
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return micros();
+#endif
+}
+
+#ifdef BUILD_FOR_PC
+struct sem {
+  std::mutex mutex;
+  std::condition_variable wake;
+  int count = 0;
+};
+
+// Never destroyed: the worker thread may still be waiting at exit
+static struct sem &free_bufs = *new sem;
+static struct sem &full_bufs = *new sem;
+static struct sem &job_ready = *new sem;
+static std::mutex &transfer_mutex = *new std::mutex;
+
+static void lock(void) { transfer_mutex.lock(); }
+
+static void unlock(void) { transfer_mutex.unlock(); }
+
+static void sem_take(struct sem &s) {
+  std::unique_lock<std::mutex> lock(s.mutex);
+  s.wake.wait(lock, [&] { return s.count > 0; });
+  s.count--;
+}
+
+static void sem_give(struct sem &s) {
+  std::lock_guard<std::mutex> lock(s.mutex);
+  s.count++;
+  s.wake.notify_one();
+}
+
+static uint32_t sim_latency_us, sim_kib_per_s;
+
+void loader_simulate_card(uint32_t latency_us, uint32_t kib_per_s) {
+  sim_latency_us = latency_us;
+  sim_kib_per_s = kib_per_s;
+}
+
+static void simulate_card(size_t bytes) {
+  if (!sim_kib_per_s) return;
+  uint64_t us = sim_latency_us + (uint64_t)bytes * 1000000 / (sim_kib_per_s * 1024);
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+#else
+static SemaphoreHandle_t free_bufs, full_bufs, job_ready, transfer_mutex;
+
+static void lock(void) { xSemaphoreTake(transfer_mutex, portMAX_DELAY); }
+
+static void unlock(void) { xSemaphoreGive(transfer_mutex); }
+
+static void sem_take(SemaphoreHandle_t s) { xSemaphoreTake(s, portMAX_DELAY); }
+
+static void sem_give(SemaphoreHandle_t s) { xSemaphoreGive(s); }
+#endif
+
+static unsigned char *buf[2];
+
+// The transfer in progress
+static FILE *job_file;
+static long job_offset;
+static size_t job_size;
+static bool job_write;
+static std::atomic<bool> job_failed;
+#ifndef BUILD_FOR_PC
+static UBaseType_t job_priority;
+#endif
+
+static uint32_t stat_bytes, stat_us;
+
+static size_t chunk_len(size_t pos, size_t size) {
+  return size - pos < LOADER_CHUNK ? size - pos : LOADER_CHUNK;
+}
+
+/* Does the card side of each transfer. After a failure the remaining chunks
+ * are skipped but still handed over, so the caller never waits forever. */
+static void worker(void *arg) {
+  for (;;) {
+    sem_take(job_ready);
+#ifndef BUILD_FOR_PC
+    vTaskPrioritySet(NULL, job_priority);
+#endif
+    // The caller may start the next transfer once it has the last chunk
+    FILE *f = job_file;
+    size_t size = job_size;
+    bool write = job_write;
+    bool ok = fseek(f, job_offset, SEEK_SET) == 0;
+    int i = 0;
+    for (size_t pos = 0; pos < size; pos += LOADER_CHUNK, i ^= 1) {
+      size_t len = chunk_len(pos, size);
+      if (write) {
+        sem_take(full_bufs);
+        if (ok) ok = fwrite(buf[i], 1, len, f) == len;
+      } else {
+        sem_take(free_bufs);
+        if (ok) ok = fread(buf[i], 1, len, f) == len;
+      }
+#ifdef BUILD_FOR_PC
+      simulate_card(len);
+#endif
+      if (!ok) job_failed = true;
+      sem_give(write ? free_bufs : full_bufs);
+    }
+  }
+}
+
+static bool start(void) {
+  if (buf[0]) return true;
+
+  for (int i = 0; i < 2; i++) {
+#ifdef BUILD_FOR_PC
+    buf[i] = (unsigned char *)malloc(LOADER_CHUNK);
+#else
+    buf[i] = (unsigned char *)heap_caps_malloc(LOADER_CHUNK, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+#endif
+  }
+  if (!buf[0] || !buf[1]) {
+    printf("No memory for the loader buffers\n");
+    free(buf[0]);
+    free(buf[1]);
+    buf[0] = buf[1] = NULL;
+    return false;
+  }
+#ifdef BUILD_FOR_PC
+  free_bufs.count = 2;
+  std::thread(worker, (void *)NULL).detach();
+#else
+  free_bufs = xSemaphoreCreateCounting(2, 2);
+  full_bufs = xSemaphoreCreateCounting(2, 0);
+  job_ready = xSemaphoreCreateBinary();
+  transfer_mutex = xSemaphoreCreateMutex();
+  xTaskCreatePinnedToCore(worker, "loader", 4096, NULL, 1, NULL, 0);
+#endif
+  return true;
+}
+
+static void begin(FILE *f, long offset, size_t size, bool write) {
+  job_file = f;
+  job_offset = offset;
+  job_size = size;
+  job_write = write;
+  job_failed = false;
+#ifndef BUILD_FOR_PC
+  // The worker runs at the caller's priority
+  job_priority = uxTaskPriorityGet(NULL);
+#endif
+  sem_give(job_ready);
+}
+
+FILE *loader_open(const char *path, const char *mode) {
+  FILE *f = fopen(path, mode);
+  if (f) setvbuf(f, NULL, _IONBF, 0);
+  return f;
+}
+
+size_t loader_read(FILE *f, long offset, void *dst, size_t size) {
+  unsigned char *p = (unsigned char *)dst;
+
+  if (!size || !start()) return 0;
+  lock();
+  uint32_t t = now_us();
+  begin(f, offset, size, false);
+  int i = 0;
+  for (size_t pos = 0; pos < size; pos += LOADER_CHUNK, i ^= 1) {
+    sem_take(full_bufs);
+    if (!job_failed) memcpy(&p[pos], buf[i], chunk_len(pos, size));
+    sem_give(free_bufs);
+  }
+  size_t done = job_failed ? 0 : size;
+  stat_bytes += done;
+  stat_us += now_us() - t;
+  unlock();
+  return done;
+}
+
+size_t loader_write(FILE *f, long offset, const void *src, size_t size) {
+  const unsigned char *p = (const unsigned char *)src;
+
+  if (!size || !start()) return 0;
+  lock();
+  uint32_t t = now_us();
+  begin(f, offset, size, true);
+  int i = 0;
+  for (size_t pos = 0; pos < size; pos += LOADER_CHUNK, i ^= 1) {
+    sem_take(free_bufs);
+    memcpy(buf[i], &p[pos], chunk_len(pos, size));
+    sem_give(full_bufs);
+  }
+  // Both buffers back means the last chunk is written
+  sem_take(free_bufs);
+  sem_take(free_bufs);
+  sem_give(free_bufs);
+  sem_give(free_bufs);
+  size_t done = job_failed ? 0 : size;
+  stat_bytes += done;
+  stat_us += now_us() - t;
+  unlock();
+  return done;
+}
+
+void loader_read_stats(struct loader_stats *stats) {
+  stats->bytes = stat_bytes;
+  stats->us = stat_us;
+  stat_bytes = stat_us = 0;
+}
@@ -0,0 +1,45 @@
+#ifndef LOADER_H
+#define LOADER_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Bulk file I/O for the SD card. Transfers go through two DMA-capable bounce
+ * buffers of LOADER_CHUNK bytes in internal SRAM: a worker task on the other
+ * core reads the next chunk from the card while the caller copies the
+ * previous one to its destination, which may be in PSRAM (and the other way
+ * round for writes). The file is unbuffered and chunks are whole sectors, so
+ * FATFS moves them straight into the bounce buffers. Transfers from several
+ * tasks take turns.
+ */
+
+// Bytes per chunk, a multiple of the 512-byte sector
+#ifndef LOADER_CHUNK
+#define LOADER_CHUNK 0x4000
+#endif
+
+#if LOADER_CHUNK % 512
+#error "LOADER_CHUNK must be a multiple of 512"
+#endif
+
+struct loader_stats {
+  uint32_t bytes;  // Transferred
+  uint32_t us;     // Time spent in loader_read() and loader_write()
+};
+
+// Opens a file for loader_read() or loader_write(), without stdio buffering
+FILE *loader_open(const char *path, const char *mode);
+// Reads size bytes at offset, which should be a multiple of 512 for full
+// speed. Returns size, or 0 on error.
+size_t loader_read(FILE *f, long offset, void *dst, size_t size);
+// Writes size bytes at offset, returns size, or 0 on error
+size_t loader_write(FILE *f, long offset, const void *src, size_t size);
+// Counters since the previous call
+void loader_read_stats(struct loader_stats *stats);
+
+#ifdef BUILD_FOR_PC
+// Makes every chunk take latency_us plus its size at kib_per_s, like a card
+void loader_simulate_card(uint32_t latency_us, uint32_t kib_per_s);
+#endif
+#endif
@@ -1,23 +1,112 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "cartram.h"
 #include "cpu.h"
+#include "latency.h"
 #include "lcd.h"
+#include "loader.h"
 #include "mem.h"
+#include "pacer.h"
 #include "rom.h"
+#include "romfile.h"
+#include "romprovider.h"
+#include "runahead.h"
 #include "sdl.h"
 #include "timer.h"
 
+#ifdef BUILD_FOR_PC
+// Access time of the simulated card, per chunk
+#define SIM_CARD_LATENCY_US 1000
+
+/* Scripted input: "<frame> <line> <state>" per line, state in hex with the
+ * directions in the low nibble and the buttons in the high one, as taken by
+ * sdl_set_joypad(). Lines starting with # are comments. */
+#define MAX_SCRIPT_EVENTS 4096
+
+struct script_event {
+  unsigned int frame, line, state;
+};
+
+static struct script_event script[MAX_SCRIPT_EVENTS];
+static int script_len, script_pos;
+
+static int script_load(const char *path) {
+  char buf[128];
+  FILE *f = fopen(path, "r");
+
+  if (!f) return 0;
+  while (script_len < MAX_SCRIPT_EVENTS && fgets(buf, sizeof(buf), f)) {
+    struct script_event *e = &script[script_len];
+    if (buf[0] != '#' && sscanf(buf, "%u %u %x", &e->frame, &e->line, &e->state) == 3) script_len++;
+  }
+  fclose(f);
+  return 1;
+}
+
+/* Applies the events due at this point of the frame */
+static void script_step(unsigned int frame) {
+  while (script_pos < script_len && script[script_pos].frame <= frame) {
+    if (script[script_pos].frame == frame && script[script_pos].line > mem_get_byte(0xFF44)) return;
+    sdl_set_joypad(script[script_pos++].state);
+  }
+}
+#endif
+
 int main(int argc, char *argv[]) {
 #ifdef BUILD_FOR_PC
   int r;
-  const char usage[] = "Usage: %s <rom>\n";
+  const char usage[] =
+      "Usage: %s [-b] [-f] [-i <script>] [-r <frames>] [-s <KiB/s>] [-z <out.gbz>] <rom>\n"
+      "  -b  benchmark the ROM providers, then exit\n"
+      "  -f  fast-forward, run uncapped\n"
+      "  -i  replay input from a script, then exit\n"
+      "  -r  run ahead by this many frames\n"
+      "  -s  read files as if from a card of this many KiB/s\n"
+      "  -z  write the ROM compressed to this file, then exit\n";
+  bool bench = false;
+  bool fast_forward = false;
+  int run_ahead = RUN_AHEAD_FRAMES;
+  const char *script_path = NULL;
+  const char *compress_path = NULL;
+  int i;
 
-  if (argc != 2) {
+  for (i = 1; i < argc - 1; i++) {
+    if (!strcmp(argv[i], "-b"))
+      bench = true;
+    else if (!strcmp(argv[i], "-f"))
+      fast_forward = true;
+    else if (!strcmp(argv[i], "-i") && i + 2 < argc)
+      script_path = argv[++i];
+    else if (!strcmp(argv[i], "-r") && i + 2 < argc)
+      run_ahead = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-s") && i + 2 < argc)
+      loader_simulate_card(SIM_CARD_LATENCY_US, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "-z") && i + 2 < argc)
+      compress_path = argv[++i];
+    else
+      break;
+  }
+  if (i != argc - 1) {
     fprintf(stderr, usage, argv[0]);
     return 0;
   }
+  if (script_path && !script_load(script_path)) {
+    fprintf(stderr, "Cannot read %s\n", script_path);
+    return 0;
+  }
+
+  if (compress_path) return !rom_file_compress(argv[argc - 1], compress_path);
+  if (bench) {
+    rom_provider_bench(argv[argc - 1]);
+    return 0;
+  }
 
-  r = rom_load(argv[1]);
+  uint64_t load_start_ns = pacer_steady_clock.now_ns();
+  uint64_t first_frame_ns = 0;
+  bool startup_logged = false;
+  r = rom_load(argv[argc - 1]);
   if (!r) return 0;
 
   sdl_init();
@@ -25,19 +114,73 @@ int main(int argc, char *argv[]) {
   printf("ROM OK!\n");
 
   gameboy_mem_init();
+  cart_ram_load(argv[argc - 1]);
   printf("Mem OK!\n");
 
   cpu_init();
   printf("CPU OK!\n");
 
-  while (1) {
-    if (!cpu_cycle()) break;
+  pacer_init(&pacer_steady_clock);
+  pacer_set_fast_forward(fast_forward);
+  runahead_init(run_ahead);
+  uint64_t report_ns = pacer_steady_clock.now_ns();
 
-    if (!lcd_cycle()) break;
+  // Frames to run after the last scripted event
+  int script_tail = 120;
 
-    timer_cycle();
+  while (!script_path || script_pos < script_len || script_tail--) {
+    // Index of this frame
+    unsigned int frame = pacer_get_frames();
+    bool render = pacer_frame_begin();
+    runahead_begin(render);
+
+    do {
+      bool frame_done = false;
+      while (!frame_done) {
+        if (script_pos < script_len && script[script_pos].frame <= frame) script_step(frame);
+        unsigned int cycles = cpu_cycle();
+        frame_done = lcd_cycle(cycles);
+        timer_cycle(cycles);
+      }
+    } while (runahead_next());
+
+    if (render) sdl_update();
+    pacer_frame_end();
+    cart_ram_poll();
+
+    if (!first_frame_ns) first_frame_ns = pacer_steady_clock.now_ns() - load_start_ns;
+    if (!startup_logged && rom_provider_load_us()) {
+      struct loader_stats card;
+      loader_read_stats(&card);
+      printf("startup: first frame after %.1f ms, ROM loaded after %.1f ms, %.1f ms waiting for banks\n",
+             first_frame_ns / 1e6, rom_provider_load_us() / 1e3, rom_provider_wait_us() / 1e3);
+      if (card.us) printf("card reads: %u KiB at %.2f MB/s\n", card.bytes / 1024, (float)card.bytes / card.us);
+      struct rom_file_stats unpack;
+      rom_file_read_stats(&unpack);
+      if (unpack.us) {
+        printf("decompression: %u KiB from %u KiB in %.1f ms, %.1f MB/s\n", unpack.unpacked / 1024,
+               unpack.packed / 1024, unpack.us / 1e3, (float)unpack.unpacked / unpack.us);
+      }
+      startup_logged = true;
+    }
+
+    if (fast_forward && pacer_get_frames() % 600 == 0) {
+      uint64_t now = pacer_steady_clock.now_ns();
+      printf("speed: %.2fx\n", 600 * 1e9 / (now - report_ns) / PACER_FRAME_RATE);
+      report_ns = now;
+    }
   }
 
+  struct runahead_stats ahead;
+  runahead_read_stats(&ahead);
+  if (ahead.frames) {
+    printf("run-ahead %d: snapshot %u us/frame, frames ahead %u us/frame\n", run_ahead,
+           ahead.snapshot_us / ahead.frames, ahead.ahead_us / ahead.frames);
+  }
+#ifdef LATENCY_PROBE
+  latency_print();
+#endif
+  cart_ram_flush();
   sdl_quit();
 #endif
   return 0;
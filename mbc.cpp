@@ -1,18 +1,37 @@
 #include "mbc.h"
 
+#include "cartram.h"
 #include "mem.h"
 #include "rom.h"
+#include "state.h"
 
 enum { NO_FILTER_WRITE, FILTER_WRITE };
 
 static unsigned int bank_upper_bits;
 static unsigned int ram_select;
+static unsigned int mbc5_bank = 1;
 
-/* Unfinished, no clock etc */
+/* Saved for snapshots */
+#define MBC_STATE(X) X(bank_upper_bits) X(ram_select) X(mbc5_bank)
+
+size_t mbc_state_size(void) { return 0 MBC_STATE(STATE_SIZE); }
+
+uint8_t *mbc_save_state(uint8_t *p) {
+  MBC_STATE(STATE_SAVE)
+  return p;
+}
+
+const uint8_t *mbc_load_state(const uint8_t *p) {
+  MBC_STATE(STATE_LOAD)
+  return p;
+}
+
+/* Also MBC2, which has no RAM banks or clock to select */
 unsigned int MBC3_write_byte(unsigned short d, unsigned char i) {
   int bank;
 
   if (d < 0x2000) {
+    cart_ram_enable((i & 0x0F) == 0x0A);
     return FILTER_WRITE;
   }
 
@@ -26,16 +45,68 @@ unsigned int MBC3_write_byte(unsigned short d, unsigned char i) {
     return FILTER_WRITE;
   }
 
+  /* RAM bank, 0x08-0x0C select the clock registers */
+  if (d < 0x6000) {
+    if (i < 0x08)
+      cart_ram_select_bank(i);
+    else if (i <= 0x0C)
+      cart_ram_select_rtc(i);
+    return FILTER_WRITE;
+  }
+
+  /* Latches the clock registers */
+  if (d < 0x8000) {
+    cart_ram_latch_rtc(i);
+    return FILTER_WRITE;
+  }
+
+  if (d >= 0xA000 && d < 0xC000) {
+    cart_ram_write(d, i);
+    return FILTER_WRITE;
+  }
+
+  return NO_FILTER_WRITE;
+}
+/* 9 bit ROM bank, bank 0 can be mapped at 4000-7fff too */
+unsigned int MBC5_write_byte(unsigned short d, unsigned char i) {
+  if (d < 0x2000) {
+    cart_ram_enable((i & 0x0F) == 0x0A);
+    return FILTER_WRITE;
+  }
+
+  /* Low 8 bits of the ROM bank at 2000-2fff, bit 8 at 3000-3fff */
+  if (d < 0x4000) {
+    if (d < 0x3000)
+      mbc5_bank = (mbc5_bank & 0x100) | i;
+    else
+      mbc5_bank = (mbc5_bank & 0xFF) | (i & 1) << 8;
+
+    mem_bank_switch(mbc5_bank);
+
+    return FILTER_WRITE;
+  }
+
+  /* RAM bank, bit 3 drives the motor on rumble carts */
+  if (d < 0x6000) {
+    cart_ram_select_bank(i & rom_get_ram_bank_mask());
+    return FILTER_WRITE;
+  }
+
   if (d < 0x8000) return FILTER_WRITE;
 
+  if (d >= 0xA000 && d < 0xC000) {
+    cart_ram_write(d, i);
+    return FILTER_WRITE;
+  }
+
   return NO_FILTER_WRITE;
 }
 unsigned int MBC1_write_byte(unsigned short d, unsigned char i) {
   int bank;
 
   if (d < 0x2000) {
+    cart_ram_enable((i & 0x0F) == 0x0A);
     return FILTER_WRITE;
-    /* TODO: Enable/disable SRAM */
   }
 
   /* Switch rom bank at 4000-7fff */
@@ -60,14 +131,21 @@ unsigned int MBC1_write_byte(unsigned short d, unsigned char i) {
     return FILTER_WRITE;
   }
 
-  /* Bit 5 and 6 of the bank selection */
+  /* Bit 5 and 6 of the bank selection, or the RAM bank if RAM select is 1 */
   if (d >= 0x4000 && d < 0x6000) {
     bank_upper_bits = (i & 0x3) << 5;
+    cart_ram_select_bank(ram_select ? bank_upper_bits >> 5 : 0);
     return FILTER_WRITE;
   }
 
   if (d >= 0x6000 && d <= 0x7FFF) {
     ram_select = i & 1;
+    cart_ram_select_bank(ram_select ? bank_upper_bits >> 5 : 0);
+    return FILTER_WRITE;
+  }
+
+  if (d >= 0xA000 && d < 0xC000) {
+    cart_ram_write(d, i);
     return FILTER_WRITE;
   }
   return NO_FILTER_WRITE;
@@ -1,5 +1,12 @@
 #ifndef MBC_H
 #define MBC_H
+#include <stddef.h>
+#include <stdint.h>
+
 unsigned int MBC1_write_byte(unsigned short, unsigned char);
 unsigned int MBC3_write_byte(unsigned short, unsigned char);
+unsigned int MBC5_write_byte(unsigned short, unsigned char);
+size_t mbc_state_size(void);
+uint8_t *mbc_save_state(uint8_t *p);
+const uint8_t *mbc_load_state(const uint8_t *p);
 #endif
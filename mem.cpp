@@ -8,28 +8,103 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cartram.h"
 #include "cpu.h"
 #include "interrupt.h"
+#include "latency.h"
 #include "lcd.h"
 #include "mbc.h"
 #include "rom.h"
 #include "sdl.h"
+#include "state.h"
 #include "timer.h"
 
+#ifndef BUILD_FOR_PC
+#include "esp_heap_caps.h"
+#endif
+
 static unsigned char *mem;
 static int DMA_pending = 0;
 static int joypad_select_buttons, joypad_select_directions;
 static uint32_t bank_switches = 0;
+static uint32_t bank_heat[MEM_HEAT_BANKS];
+static unsigned int rom_bank = 1;  /* Bank copied to 0x4000-0x7FFF */
+/* Presses taken while running ahead, not part of the state so they survive
+ * its restore and reach the game's own frame as well */
+static bool joypad_ahead;
+static unsigned int joypad_ahead_presses;
+
+/* Saved for snapshots, along with everything from 0x8000 up. The ROM area
+ * only needs the bank number. */
+#define MEM_STATE(X) \
+  X(DMA_pending) X(joypad_select_buttons) X(joypad_select_directions) X(rom_bank)
+#define MEM_STATE_BYTES 0x8000
 
 uint32_t mem_get_bank_switches() { return bank_switches; }
 
+const uint32_t *mem_get_bank_heat(void) { return bank_heat; }
+
 void mem_bank_switch(unsigned int n) {
-  const unsigned char *b = rom_getbytes();
   bank_switches++;
+  bank_heat[n % MEM_HEAT_BANKS]++;
+  rom_bank = n;
+
+  /* Let the heat fade so the hot banks follow the game */
+  if (bank_switches % MEM_HEAT_PERIOD == 0) {
+    rom_place_hot_banks(bank_heat, MEM_HEAT_BANKS);
+    for (int i = 0; i < MEM_HEAT_BANKS; i++) bank_heat[i] /= 2;
+  }
+
+  memcpy(&mem[0x4000], rom_get_bank(n), 0x4000);
+}
+
+size_t mem_state_size(void) { return MEM_STATE_BYTES MEM_STATE(STATE_SIZE); }
+
+uint8_t *mem_save_state(uint8_t *p) {
+  memcpy(p, &mem[0x8000], MEM_STATE_BYTES);
+  p += MEM_STATE_BYTES;
+  MEM_STATE(STATE_SAVE)
+  return p;
+}
+
+const uint8_t *mem_load_state(const uint8_t *p) {
+  unsigned int bank = rom_bank;
+
+#ifdef LCD_TRACK_VRAM
+  /* The LCD caches follow VRAM writes, replay the bytes that differ */
+  for (int i = 0; i < 0x2000; i += 32) {
+    if (!memcmp(&mem[0x8000 + i], &p[i], 32)) continue;
+    for (int j = i; j < i + 32; j++) lcd_write_vram(0x8000 + j, p[j]);
+  }
+#endif
+  memcpy(&mem[0x8000], p, MEM_STATE_BYTES);
+  p += MEM_STATE_BYTES;
+  MEM_STATE(STATE_LOAD)
 
-  memcpy(&mem[0x4000], &b[n * 0x4000], 0x4000);
+  if (rom_bank != bank)
+    memcpy(&mem[0x4000], rom_get_bank(rom_bank), 0x4000);
+  return p;
 }
 
+/* Raises the joypad interrupt if a button of a selected group was pressed
+ * since the last call, as its P10-P13 line went from high to low */
+void mem_joypad_poll(void) {
+  unsigned int presses = sdl_take_joypad_presses();
+
+  if (joypad_ahead) {
+    joypad_ahead_presses |= presses;
+  } else {
+    presses |= joypad_ahead_presses;
+    joypad_ahead_presses = 0;
+  }
+
+  if ((!joypad_select_directions && (presses & 0x0F)) ||
+      (!joypad_select_buttons && (presses & 0xF0)))
+    interrupt(INTR_JOYPAD);
+}
+
+void mem_joypad_set_ahead(bool ahead) { joypad_ahead = ahead; }
+
 /* LCD's access to VRAM */
 const unsigned char *mem_get_raw() { return mem; }
 
@@ -49,9 +124,13 @@ unsigned char mem_get_byte(unsigned short i) {
   if (i < 0xFF00) return mem[i];
 
   switch (i) {
-    case 0xFF00: /* Joypad */
-      if (!joypad_select_buttons) mask = sdl_get_buttons();
-      if (!joypad_select_directions) mask = sdl_get_directions();
+    case 0xFF00: /* Joypad, sampled now rather than once per frame */
+      if (!joypad_select_buttons) mask |= sdl_get_buttons();
+      if (!joypad_select_directions) mask |= sdl_get_directions();
+#ifdef LATENCY_PROBE
+      latency_read((joypad_select_buttons ? 0 : sdl_get_buttons() << 4) |
+                   (joypad_select_directions ? 0 : sdl_get_directions()));
+#endif
       return 0xC0 | (0xF ^ mask) |
              (joypad_select_buttons | joypad_select_directions);
       break;
@@ -107,6 +186,10 @@ void mem_write_byte(unsigned short d, unsigned char i) {
   switch (rom_get_mapper()) {
     case NROM:
       if (d < 0x8000) filtered = 1;
+      if (d >= 0xA000 && d < 0xC000) {
+        cart_ram_write(d, i);
+        filtered = 1;
+      }
       break;
     case MBC2:
     case MBC3:
@@ -115,10 +198,17 @@ void mem_write_byte(unsigned short d, unsigned char i) {
     case MBC1:
       filtered = MBC1_write_byte(d, i);
       break;
+    case MBC5:
+      filtered = MBC5_write_byte(d, i);
+      break;
   }
 
   if (filtered) return;
 
+#ifdef LCD_TRACK_VRAM
+  if (d >= 0x8000 && d < 0xA000) lcd_write_vram(d, i);
+#endif
+
   switch (d) {
     case 0xFF00: /* Joypad */
       joypad_select_buttons = i & 0x20;
@@ -187,17 +277,26 @@ void mem_write_byte(unsigned short d, unsigned char i) {
 }
 
 void mem_write_word(unsigned short d, unsigned short i) {
-  mem[d] = i & 0xFF;
-  mem[d + 1] = i >> 8;
+  mem_write_byte(d, i & 0xFF);
+  mem_write_byte(d + 1, i >> 8);
 }
 
 void gameboy_mem_init(void) {
-  const unsigned char *bytes = rom_getbytes();
-
-  mem = (unsigned char *)calloc(1, 0x10000);
+  /* Bank 0 and the current bank are read all the time, keep them out of
+   * PSRAM if possible. Kept for the next ROM. */
+  if (mem) {
+    memset(mem, 0, 0x10000);
+  } else {
+#ifdef BUILD_FOR_PC
+    mem = (unsigned char *)calloc(1, 0x10000);
+#else
+    mem = (unsigned char *)heap_caps_calloc(1, 0x10000, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!mem) mem = (unsigned char *)calloc(1, 0x10000);
+#endif
+  }
 
-  memcpy(&mem[0x0000], &bytes[0x0000], 0x4000);
-  memcpy(&mem[0x4000], &bytes[0x4000], 0x4000);
+  memcpy(&mem[0x0000], rom_get_bank(0), 0x4000);
+  memcpy(&mem[0x4000], rom_get_bank(1), 0x4000);
 
   mem[0xFF10] = 0x80;
   mem[0xFF11] = 0xBF;
@@ -218,6 +317,8 @@ void gameboy_mem_init(void) {
   mem[0xFF47] = 0xFC;
   mem[0xFF48] = 0xFF;
   mem[0xFF49] = 0xFF;
+
+  cart_ram_init(&mem[0xA000]);
 }
 
 #endif  // INTER_MODULE_OPT
\ No newline at end of file
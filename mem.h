@@ -7,6 +7,7 @@ extern "C" {
 #endif
 
 #include <cinttypes>
+#include <stddef.h>
 
 #include "rom.h"
 void gameboy_mem_init(void);
@@ -17,6 +18,18 @@ void mem_write_word(unsigned short, unsigned short);
 void mem_bank_switch(unsigned int);
 const unsigned char *mem_get_raw();
 uint32_t mem_get_bank_switches();
+/* Switches to each bank, halved every MEM_HEAT_PERIOD switches. Bank numbers
+ * wrap around MEM_HEAT_BANKS. */
+#define MEM_HEAT_BANKS 512
+#define MEM_HEAT_PERIOD 4096
+const uint32_t *mem_get_bank_heat(void);
+void mem_joypad_poll(void);
+/* While frames are run ahead, presses are shown to them and kept for the
+ * game's next real frame, as the state restore would lose them */
+void mem_joypad_set_ahead(bool ahead);
+size_t mem_state_size(void);
+uint8_t *mem_save_state(uint8_t *p);
+const uint8_t *mem_load_state(const uint8_t *p);
 #ifdef __cplusplus
 }
 
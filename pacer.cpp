@@ -0,0 +1,184 @@
+#include "pacer.h"
+
+#include <algorithm>
+
+#ifdef BUILD_FOR_PC
+#include <chrono>
+#include <thread>
+#else
+#include <Arduino.h>
+#endif
+
+// One frame is FRAME_NUM / FRAME_DEN nanoseconds, about 16742706.3
+#define FRAME_NUM (70224ull * 1000000000ull)
+#define FRAME_DEN 4194304ull
+#define FRAME_NS (FRAME_NUM / FRAME_DEN)
+
+#define JITTER_FRAMES 256
+
+static const struct pacer_clock *time_source;
+static uint64_t deadline;      // End of the current frame's time slot
+static uint64_t deadline_rem;  // Fraction of a nanosecond, over FRAME_DEN
+static uint64_t last_end;      // When the previous frame ended
+static int skip_run;           // Frames skipped in a row
+static uint32_t frames;
+static uint32_t skipped;
+static uint32_t resyncs;
+static bool fast_forward;
+static int decimate;           // Frames until the next rendered one
+
+static uint32_t jitter_us[JITTER_FRAMES];
+static int jitter_count;
+static int jitter_pos;
+
+#ifdef BUILD_FOR_PC
+static uint64_t steady_now_ns(void) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void steady_sleep_until_ns(uint64_t t) {
+  std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(t)));
+}
+
+const struct pacer_clock pacer_steady_clock = { steady_now_ns, steady_sleep_until_ns };
+
+static uint64_t fake_ns;
+
+static uint64_t fake_now_ns(void) { return fake_ns; }
+
+static void fake_sleep_until_ns(uint64_t t) {
+  if (t > fake_ns) fake_ns = t;
+}
+
+void pacer_fake_advance(uint64_t ns) { fake_ns += ns; }
+
+const struct pacer_clock pacer_fake_clock = { fake_now_ns, fake_sleep_until_ns };
+#else
+static uint64_t cycle_now_ns(void) {
+  static uint32_t cpu_mhz;
+  static uint32_t last;
+  static uint64_t high;  // Wraps of the 32-bit counter, every 18 s at 240 MHz
+
+  if (!cpu_mhz) cpu_mhz = getCpuFrequencyMhz();
+  uint32_t c = ESP.getCycleCount();
+  if (c < last) high += 1ull << 32;
+  last = c;
+  return (high | c) * 1000 / cpu_mhz;
+}
+
+static void cycle_sleep_until_ns(uint64_t t) {
+  // Give the scheduler whole ticks, then spin for the rest
+  uint64_t now = cycle_now_ns();
+  if (t > now + 2000000) delay((t - now) / 1000000 - 1);
+  while (cycle_now_ns() < t) {
+  }
+}
+
+const struct pacer_clock pacer_cycle_clock = { cycle_now_ns, cycle_sleep_until_ns };
+#endif
+
+// Moves the deadline on by exactly one frame
+static void advance_deadline(void) {
+  deadline += FRAME_NS;
+  deadline_rem += FRAME_NUM % FRAME_DEN;
+  if (deadline_rem >= FRAME_DEN) {
+    deadline_rem -= FRAME_DEN;
+    deadline++;
+  }
+}
+
+void pacer_init(const struct pacer_clock *c) {
+  time_source = c;
+  last_end = time_source->now_ns();
+  deadline = last_end;
+  deadline_rem = 0;
+  advance_deadline();
+  skip_run = 0;
+  frames = skipped = resyncs = 0;
+  fast_forward = false;
+  jitter_count = jitter_pos = 0;
+}
+
+bool pacer_frame_begin(void) {
+  if (fast_forward) {
+    frames++;
+    if (decimate--) {
+      skipped++;
+      return false;
+    }
+    decimate = FAST_FORWARD_RENDER_EVERY - 1;
+    return true;
+  }
+
+  // Starting after the frame should already have ended: a whole frame behind
+  bool behind = time_source->now_ns() >= deadline;
+  frames++;
+  if (skip_run < FRAMESKIP_MIN || (behind && skip_run < FRAMESKIP_MAX)) {
+    skip_run++;
+    skipped++;
+    return false;
+  }
+  skip_run = 0;
+  return true;
+}
+
+void pacer_frame_end(void) {
+  uint64_t now = time_source->now_ns();
+
+  if (fast_forward) {
+    // No waiting, and no backlog left for when pacing resumes
+    deadline = now;
+    deadline_rem = 0;
+    advance_deadline();
+    last_end = now;
+    return;
+  }
+
+  if (now < deadline) {
+    time_source->sleep_until_ns(deadline);
+    now = time_source->now_ns();
+  } else if (now - deadline > PACER_MAX_BEHIND * FRAME_NS) {
+    // Too far behind to catch up by skipping, start over from here
+    deadline = now - PACER_MAX_BEHIND * FRAME_NS;
+    resyncs++;
+  }
+  advance_deadline();
+
+  uint64_t interval = now - last_end;
+  uint64_t deviation = interval > FRAME_NS ? interval - FRAME_NS : FRAME_NS - interval;
+  jitter_us[jitter_pos] = std::min<uint64_t>(deviation / 1000, UINT32_MAX);
+  jitter_pos = (jitter_pos + 1) % JITTER_FRAMES;
+  if (jitter_count < JITTER_FRAMES) jitter_count++;
+  last_end = now;
+}
+
+void pacer_set_fast_forward(bool on) {
+  if (on && !fast_forward) decimate = 0;
+  fast_forward = on;
+}
+
+bool pacer_get_fast_forward(void) { return fast_forward; }
+
+uint32_t pacer_get_frames(void) { return frames; }
+
+uint32_t pacer_get_skipped(void) { return skipped; }
+
+uint32_t pacer_get_resyncs(void) { return resyncs; }
+
+void pacer_get_jitter(struct pacer_jitter *jitter) {
+  uint32_t sorted[JITTER_FRAMES];
+  int n = jitter_count;
+
+  if (!n) {
+    *jitter = {};
+    return;
+  }
+  std::copy(jitter_us, jitter_us + n, sorted);
+  std::sort(sorted, sorted + n);
+  jitter->p50 = sorted[n * 50 / 100];
+  jitter->p95 = sorted[n * 95 / 100];
+  jitter->p99 = sorted[n * 99 / 100];
+  jitter->max = sorted[n - 1];
+}
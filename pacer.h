@@ -0,0 +1,73 @@
+#ifndef PACER_H
+#define PACER_H
+#include <stdint.h>
+
+/*
+ * Frame pacing and frameskip. Every frame has an absolute deadline that
+ * advances by exactly one DMG frame (70224 cycles at 4194304 Hz), so sleep
+ * overshoot and rounding never accumulate into drift. Frames that start
+ * after their deadline are emulated without rendering until emulation has
+ * caught up; a backlog of more than PACER_MAX_BEHIND frames is forgiven.
+ */
+
+// DMG refresh rate: 4194304 Hz / 70224 cycles per frame
+#define PACER_FRAME_RATE 59.7275
+
+// Frames skipped in a row at least (a fixed frameskip, 0 renders every frame
+// that is on time) and at most, even when further behind
+#ifndef FRAMESKIP_MIN
+#define FRAMESKIP_MIN 0
+#endif
+#ifndef FRAMESKIP_MAX
+#define FRAMESKIP_MAX 4
+#endif
+
+// Frames the pacer may fall behind before it stops trying to catch up
+#ifndef PACER_MAX_BEHIND
+#define PACER_MAX_BEHIND (FRAMESKIP_MAX + 1)
+#endif
+
+// While fast-forwarding, one frame in this many is rendered and presented
+#ifndef FAST_FORWARD_RENDER_EVERY
+#define FAST_FORWARD_RENDER_EVERY 8
+#endif
+
+// Time source of the pacer, monotonic nanoseconds
+struct pacer_clock {
+  uint64_t (*now_ns)(void);
+  void (*sleep_until_ns)(uint64_t deadline);
+};
+
+#ifdef BUILD_FOR_PC
+extern const struct pacer_clock pacer_steady_clock;
+// Simulated time: only pacer_fake_advance() and sleeping move it forward
+extern const struct pacer_clock pacer_fake_clock;
+void pacer_fake_advance(uint64_t ns);
+#else
+// CPU cycle counter of the calling core
+extern const struct pacer_clock pacer_cycle_clock;
+#endif
+
+// Deviation of frame intervals from the DMG frame time, in microseconds,
+// over the last 256 frames
+struct pacer_jitter {
+  uint32_t p50, p95, p99, max;
+};
+
+void pacer_init(const struct pacer_clock *clock);
+// Starts a frame, returns false if it should be emulated without rendering
+bool pacer_frame_begin(void);
+// Ends the frame and waits for its deadline
+void pacer_frame_end(void);
+// Fast-forward runs as fast as the CPU allows and renders one frame in
+// FAST_FORWARD_RENDER_EVERY. Audio output must check pacer_get_fast_forward()
+// and drop samples rather than wait for room in its buffer.
+void pacer_set_fast_forward(bool on);
+bool pacer_get_fast_forward(void);
+// Frames paced, and of those emulated without rendering, so far
+uint32_t pacer_get_frames(void);
+uint32_t pacer_get_skipped(void);
+// Times the backlog went over PACER_MAX_BEHIND and was forgiven
+uint32_t pacer_get_resyncs(void);
+void pacer_get_jitter(struct pacer_jitter *jitter);
+#endif
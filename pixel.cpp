@@ -0,0 +1,526 @@
+#include "pixel.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__XTENSA__) || defined(PIXEL_FORCE_SWAR)
+#define PIXEL_SWAR
+#elif defined(__SSE2__)
+#define PIXEL_SSE2
+#include <emmintrin.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef BUILD_FOR_PC
+#include <chrono>
+#else
+#include <Arduino.h>
+#endif
+
+/* Scalar reference kernels */
+
+static void expand_2bpp_scalar(const uint8_t *src, uint8_t *dst, int n) {
+  for (int i = 0; i < n; i++) {
+    dst[i] = (src[i / 4] >> (6 - 2 * (i & 3))) & 3;
+  }
+}
+
+static void apply_lut_scalar(const uint8_t *src, uint16_t *dst,
+                             const uint16_t *lut, int n) {
+  for (int i = 0; i < n; i++) dst[i] = lut[src[i] & 3];
+}
+
+static void scale_3_2_8_scalar(const uint8_t *src, uint8_t *dst, int n) {
+  int i;
+  for (i = 0; i + 1 < n; i += 2) {
+    dst[0] = src[i];
+    dst[1] = dst[2] = src[i + 1];
+    dst += 3;
+  }
+  if (i < n) dst[0] = src[i];
+}
+
+static void scale_3_2_16_scalar(const uint16_t *src, uint16_t *dst, int n) {
+  int i;
+  for (i = 0; i + 1 < n; i += 2) {
+    dst[0] = src[i];
+    dst[1] = dst[2] = src[i + 1];
+    dst += 3;
+  }
+  if (i < n) dst[0] = src[i];
+}
+
+static void bswap16_scalar(uint16_t *buf, int n) {
+  for (int i = 0; i < n; i++) buf[i] = (buf[i] >> 8) | (buf[i] << 8);
+}
+
+#ifdef PIXEL_SWAR
+/* 32-bit SWAR kernels. Xtensa faults on unaligned word access, so they
+ * only run on 4-byte aligned buffers and fall back to scalar otherwise. */
+
+static bool aligned4(const void *a, const void *b) {
+  return (((uintptr_t)a | (uintptr_t)b) & 3) == 0;
+}
+
+// Word access through memcpy keeps strict aliasing happy and still
+// compiles to a single load or store on aligned pointers
+static uint32_t load32(const void *p) {
+  uint32_t w;
+  memcpy(&w, __builtin_assume_aligned(p, 4), 4);
+  return w;
+}
+
+static void store32(void *p, uint32_t w) {
+  memcpy(__builtin_assume_aligned(p, 4), &w, 4);
+}
+
+static uint32_t expand_table[256];
+
+void pixel_expand_2bpp(const uint8_t *src, uint8_t *dst, int n) {
+  if (!aligned4(src, dst)) return expand_2bpp_scalar(src, dst, n);
+
+  if (!expand_table[0xFF]) {
+    for (int b = 0; b < 256; b++) {
+      expand_table[b] = (b >> 6) | ((b >> 4) & 3) << 8 |
+                        ((b >> 2) & 3) << 16 | (uint32_t)(b & 3) << 24;
+    }
+  }
+
+  int i;
+  for (i = 0; i + 4 <= n; i += 4) store32(dst + i, expand_table[src[i / 4]]);
+  expand_2bpp_scalar(src + i / 4, dst + i, n - i);
+}
+
+void pixel_apply_lut(const uint8_t *src, uint16_t *dst, const uint16_t *lut,
+                     int n) {
+  if (!aligned4(src, dst)) return apply_lut_scalar(src, dst, lut, n);
+
+  // Both pixels of a 32-bit word in one lookup
+  uint32_t pairs[16];
+  for (int i = 0; i < 16; i++) pairs[i] = lut[i & 3] | (uint32_t)lut[i >> 2] << 16;
+
+  int i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    uint32_t w = load32(src + i);
+    store32(dst + i, pairs[(w & 3) | (w >> 6 & 0xC)]);
+    store32(dst + i + 2, pairs[(w >> 16 & 3) | (w >> 22 & 0xC)]);
+  }
+  apply_lut_scalar(src + i, dst + i, lut, n - i);
+}
+
+void pixel_scale_3_2_8(const uint8_t *src, uint8_t *dst, int n) {
+  if (!aligned4(src, dst)) return scale_3_2_8_scalar(src, dst, n);
+
+  // p0..p7 -> p0 p1 p1 p2 | p3 p3 p4 p5 | p5 p6 p7 p7
+  int i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    uint32_t w0 = load32(src + i);
+    uint32_t w1 = load32(src + i + 4);
+    uint8_t *out = dst + i * 3 / 2;
+    store32(out, (w0 & 0xFFFF) | (w0 & 0xFF00) << 8 | (w0 & 0xFF0000) << 8);
+    store32(out + 4, w0 >> 24 | (w0 >> 16 & 0xFF00) | w1 << 16);
+    store32(out + 8, (w1 >> 8 & 0xFFFFFF) | (w1 & 0xFF000000));
+  }
+  scale_3_2_8_scalar(src + i, dst + i * 3 / 2, n - i);
+}
+
+void pixel_scale_3_2_16(const uint16_t *src, uint16_t *dst, int n) {
+  if (!aligned4(src, dst)) return scale_3_2_16_scalar(src, dst, n);
+
+  // q0..q3 -> q0 q1 | q1 q2 | q3 q3
+  int i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    uint32_t w0 = load32(src + i);
+    uint32_t w1 = load32(src + i + 2);
+    uint16_t *out = dst + i * 3 / 2;
+    store32(out, w0);
+    store32(out + 2, w0 >> 16 | w1 << 16);
+    store32(out + 4, w1 >> 16 | (w1 & 0xFFFF0000));
+  }
+  scale_3_2_16_scalar(src + i, dst + i * 3 / 2, n - i);
+}
+
+void pixel_bswap16(uint16_t *buf, int n) {
+  if (!aligned4(buf, buf)) return bswap16_scalar(buf, n);
+
+  int i;
+  for (i = 0; i + 2 <= n; i += 2) {
+    uint32_t w = load32(buf + i);
+    store32(buf + i, (w & 0x00FF00FF) << 8 | (w >> 8 & 0x00FF00FF));
+  }
+  bswap16_scalar(buf + i, n - i);
+}
+
+const char *pixel_backend(void) { return "swar32"; }
+
+#elif defined(PIXEL_SSE2)
+
+void pixel_expand_2bpp(const uint8_t *src, uint8_t *dst, int n) {
+  // Field r of each byte sits at bit 6 - 2r; after shifting left by 2 a
+  // high multiply by 2^(8 + 2r) moves it to bit 0 of a 16-bit lane
+  const __m128i mult = _mm_setr_epi16(1 << 8, 1 << 10, 1 << 12, 1 << 14,
+                                      1 << 8, 1 << 10, 1 << 12, 1 << 14);
+  const __m128i three = _mm_set1_epi16(3);
+  const __m128i zero = _mm_setzero_si128();
+  int i;
+  for (i = 0; i + 16 <= n; i += 16) {
+    uint32_t w;
+    memcpy(&w, src + i / 4, 4);
+    __m128i b = _mm_cvtsi32_si128(w);
+    b = _mm_unpacklo_epi8(b, b);
+    b = _mm_unpacklo_epi16(b, b);
+    __m128i lo = _mm_slli_epi16(_mm_unpacklo_epi8(b, zero), 2);
+    __m128i hi = _mm_slli_epi16(_mm_unpackhi_epi8(b, zero), 2);
+    lo = _mm_and_si128(_mm_mulhi_epu16(lo, mult), three);
+    hi = _mm_and_si128(_mm_mulhi_epu16(hi, mult), three);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+  }
+  expand_2bpp_scalar(src + i / 4, dst + i, n - i);
+}
+
+void pixel_apply_lut(const uint8_t *src, uint16_t *dst, const uint16_t *lut,
+                     int n) {
+  int i = 0;
+#ifdef __AVX2__
+  {
+    const __m256i c1 = _mm256_set1_epi16(1), c2 = _mm256_set1_epi16(2),
+                  c3 = _mm256_set1_epi16(3);
+    const __m256i l0 = _mm256_set1_epi16(lut[0]), l1 = _mm256_set1_epi16(lut[1]),
+                  l2 = _mm256_set1_epi16(lut[2]), l3 = _mm256_set1_epi16(lut[3]);
+    for (; i + 16 <= n; i += 16) {
+      __m256i idx = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i)));
+      idx = _mm256_and_si256(idx, c3);
+      __m256i v = l0;
+      v = _mm256_blendv_epi8(v, l1, _mm256_cmpeq_epi16(idx, c1));
+      v = _mm256_blendv_epi8(v, l2, _mm256_cmpeq_epi16(idx, c2));
+      v = _mm256_blendv_epi8(v, l3, _mm256_cmpeq_epi16(idx, c3));
+      _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+  }
+#endif
+  const __m128i c1 = _mm_set1_epi16(1), c2 = _mm_set1_epi16(2),
+                c3 = _mm_set1_epi16(3);
+  const __m128i l0 = _mm_set1_epi16(lut[0]), l1 = _mm_set1_epi16(lut[1]),
+                l2 = _mm_set1_epi16(lut[2]), l3 = _mm_set1_epi16(lut[3]);
+  for (; i + 8 <= n; i += 8) {
+    __m128i idx = _mm_loadl_epi64((const __m128i *)(src + i));
+    idx = _mm_and_si128(_mm_unpacklo_epi8(idx, _mm_setzero_si128()), c3);
+    __m128i v = l0, m;
+    m = _mm_cmpeq_epi16(idx, c1);
+    v = _mm_or_si128(_mm_and_si128(m, l1), _mm_andnot_si128(m, v));
+    m = _mm_cmpeq_epi16(idx, c2);
+    v = _mm_or_si128(_mm_and_si128(m, l2), _mm_andnot_si128(m, v));
+    m = _mm_cmpeq_epi16(idx, c3);
+    v = _mm_or_si128(_mm_and_si128(m, l3), _mm_andnot_si128(m, v));
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+  apply_lut_scalar(src + i, dst + i, lut, n - i);
+}
+
+void pixel_scale_3_2_8(const uint8_t *src, uint8_t *dst, int n) {
+  int i = 0;
+#ifdef __SSSE3__
+  // 16 source pixels -> 24 target pixels
+  const __m128i m1 = _mm_setr_epi8(0, 1, 1, 2, 3, 3, 4, 5, 5, 6, 7, 7, 8, 9, 9, 10);
+  const __m128i m2 = _mm_setr_epi8(11, 11, 12, 13, 13, 14, 15, 15,
+                                   -1, -1, -1, -1, -1, -1, -1, -1);
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i * 3 / 2), _mm_shuffle_epi8(v, m1));
+    _mm_storel_epi64((__m128i *)(dst + i * 3 / 2 + 16), _mm_shuffle_epi8(v, m2));
+  }
+#endif
+  scale_3_2_8_scalar(src + i, dst + i * 3 / 2, n - i);
+}
+
+void pixel_scale_3_2_16(const uint16_t *src, uint16_t *dst, int n) {
+  int i = 0;
+#ifdef __SSSE3__
+  // 8 source pixels -> 12 target pixels
+  const __m128i m1 = _mm_setr_epi8(0, 1, 2, 3, 2, 3, 4, 5, 6, 7, 6, 7, 8, 9, 10, 11);
+  const __m128i m2 = _mm_setr_epi8(10, 11, 12, 13, 14, 15, 14, 15,
+                                   -1, -1, -1, -1, -1, -1, -1, -1);
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i * 3 / 2), _mm_shuffle_epi8(v, m1));
+    _mm_storel_epi64((__m128i *)(dst + i * 3 / 2 + 8), _mm_shuffle_epi8(v, m2));
+  }
+#endif
+  scale_3_2_16_scalar(src + i, dst + i * 3 / 2, n - i);
+}
+
+void pixel_bswap16(uint16_t *buf, int n) {
+  int i = 0;
+#ifdef __AVX2__
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+    v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+    _mm256_storeu_si256((__m256i *)(buf + i), v);
+  }
+#endif
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(buf + i), v);
+  }
+  bswap16_scalar(buf + i, n - i);
+}
+
+const char *pixel_backend(void) {
+#if defined(__AVX2__)
+  return "avx2";
+#elif defined(__SSSE3__)
+  return "ssse3";
+#else
+  return "sse2";
+#endif
+}
+
+#else
+
+void pixel_expand_2bpp(const uint8_t *src, uint8_t *dst, int n) {
+  expand_2bpp_scalar(src, dst, n);
+}
+
+void pixel_apply_lut(const uint8_t *src, uint16_t *dst, const uint16_t *lut,
+                     int n) {
+  apply_lut_scalar(src, dst, lut, n);
+}
+
+void pixel_scale_3_2_8(const uint8_t *src, uint8_t *dst, int n) {
+  scale_3_2_8_scalar(src, dst, n);
+}
+
+void pixel_scale_3_2_16(const uint16_t *src, uint16_t *dst, int n) {
+  scale_3_2_16_scalar(src, dst, n);
+}
+
+void pixel_bswap16(uint16_t *buf, int n) { bswap16_scalar(buf, n); }
+
+const char *pixel_backend(void) { return "scalar"; }
+
+#endif
+
+/* Self test and micro benchmark */
+
+#define TEST_PIXELS 200
+
+static uint32_t rng_state = 1;
+
+static uint8_t test_random(void) {
+  rng_state = rng_state * 1103515245 + 12345;
+  return rng_state >> 16;
+}
+
+static uint32_t now_us(void) {
+#ifdef BUILD_FOR_PC
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return micros();
+#endif
+}
+
+/* Known answers, 20 pixels to reach the 16-pixel loops and leave a tail.
+ * Checked for the scalar kernels too, which the comparisons below take as
+ * the reference. */
+static const uint8_t ka_packed[5] = {0x1B, 0xE4, 0x00, 0xFF, 0x6C};
+static const uint8_t ka_colours[20] = {0, 1, 2, 3, 3, 2, 1, 0, 0, 0,
+                                       0, 0, 3, 3, 3, 3, 1, 2, 3, 0};
+static const uint16_t ka_lut[4] = {0xFFFF, 0x8410, 0x4208, 0x0000};
+static const uint16_t ka_rgb[20] = {
+    0xFFFF, 0x8410, 0x4208, 0x0000, 0x0000, 0x4208, 0x8410, 0xFFFF, 0xFFFF, 0xFFFF,
+    0xFFFF, 0xFFFF, 0x0000, 0x0000, 0x0000, 0x0000, 0x8410, 0x4208, 0x0000, 0xFFFF};
+// Scaling 0, 1, 2, ... 19
+static const uint8_t ka_scaled[30] = {0,  1,  1,  2,  3,  3,  4,  5,  5,  6,
+                                      7,  7,  8,  9,  9,  10, 11, 11, 12, 13,
+                                      13, 14, 15, 15, 16, 17, 17, 18, 19, 19};
+static const uint16_t ka_words[20] = {
+    0x1234, 0xABCD, 0x00FF, 0xFF00, 0x8001, 0x7FFE, 0x0102, 0xF00F, 0x5AA5, 0xC33C,
+    0x0000, 0xFFFF, 0x1357, 0x2468, 0x9BDF, 0xACE0, 0x0F0F, 0xF0F0, 0x4321, 0xDCBA};
+static const uint16_t ka_swapped[20] = {
+    0x3412, 0xCDAB, 0xFF00, 0x00FF, 0x0180, 0xFE7F, 0x0201, 0x0FF0, 0xA55A, 0x3CC3,
+    0x0000, 0xFFFF, 0x5713, 0x6824, 0xDF9B, 0xE0AC, 0x0F0F, 0xF0F0, 0x2143, 0xBADC};
+
+// Runs each kernel, then its scalar version, on the known answers
+static int known_answers(int offset) {
+  alignas(16) uint8_t in8[32], out8[48];
+  alignas(16) uint16_t in16[32], out16[48];
+  int failures = 0;
+
+  for (int scalar = 0; scalar < 2; scalar++) {
+    const char *kind = scalar ? "scalar" : pixel_backend();
+
+    memcpy(in8 + offset, ka_packed, sizeof(ka_packed));
+    if (scalar) expand_2bpp_scalar(in8 + offset, out8 + offset, 20);
+    else pixel_expand_2bpp(in8 + offset, out8 + offset, 20);
+    if (memcmp(out8 + offset, ka_colours, sizeof(ka_colours))) {
+      printf("%s expand_2bpp known answer failed, offset=%d\n", kind, offset);
+      failures++;
+    }
+
+    memcpy(in8 + offset, ka_colours, sizeof(ka_colours));
+    if (scalar) apply_lut_scalar(in8 + offset, out16 + offset, ka_lut, 20);
+    else pixel_apply_lut(in8 + offset, out16 + offset, ka_lut, 20);
+    if (memcmp(out16 + offset, ka_rgb, sizeof(ka_rgb))) {
+      printf("%s apply_lut known answer failed, offset=%d\n", kind, offset);
+      failures++;
+    }
+
+    for (int i = 0; i < 20; i++) in8[offset + i] = i;
+    if (scalar) scale_3_2_8_scalar(in8 + offset, out8 + offset, 20);
+    else pixel_scale_3_2_8(in8 + offset, out8 + offset, 20);
+    if (memcmp(out8 + offset, ka_scaled, sizeof(ka_scaled))) {
+      printf("%s scale_3_2_8 known answer failed, offset=%d\n", kind, offset);
+      failures++;
+    }
+
+    memcpy(in16 + offset, ka_words, sizeof(ka_words));
+    if (scalar) scale_3_2_16_scalar(in16 + offset, out16 + offset, 20);
+    else pixel_scale_3_2_16(in16 + offset, out16 + offset, 20);
+    for (int i = 0; i < 30; i++) {
+      if (out16[offset + i] != ka_words[ka_scaled[i]]) {
+        printf("%s scale_3_2_16 known answer failed, offset=%d\n", kind, offset);
+        failures++;
+        break;
+      }
+    }
+
+    memcpy(out16 + offset, ka_words, sizeof(ka_words));
+    if (scalar) bswap16_scalar(out16 + offset, 20);
+    else pixel_bswap16(out16 + offset, 20);
+    if (memcmp(out16 + offset, ka_swapped, sizeof(ka_swapped))) {
+      printf("%s bswap16 known answer failed, offset=%d\n", kind, offset);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+int pixel_selftest(void) {
+  alignas(16) uint8_t src8[TEST_PIXELS + 16];
+  alignas(16) uint16_t src16[TEST_PIXELS + 16];
+  alignas(16) uint8_t out8[2][TEST_PIXELS * 2];
+  alignas(16) uint16_t out16[2][TEST_PIXELS * 2];
+  const uint16_t lut[4] = {0xFFFF, 0x8410, 0x4208, 0x0000};
+  // Lengths around every vector width, odd tails and a misaligned start
+  const int lengths[] = {0, 1, 2, 3, 4, 7, 8, 9, 15, 16, 17, 31, 33, 160, 199};
+  int failures = 0;
+
+  for (int offset = 0; offset < 2; offset++) {
+    failures += known_answers(offset);
+    for (int i = 0; i < TEST_PIXELS + 16; i++) {
+      src8[i] = test_random();
+      src16[i] = test_random() << 8 | test_random();
+    }
+    const uint8_t *s8 = src8 + offset;
+    const uint16_t *s16 = src16 + offset;
+
+    for (int n : lengths) {
+      memset(out8, 0x55, sizeof(out8));
+      expand_2bpp_scalar(s8, out8[0], n);
+      pixel_expand_2bpp(s8, out8[1], n);
+      if (memcmp(out8[0], out8[1], sizeof(out8[0]))) {
+        printf("pixel_expand_2bpp failed for n=%d offset=%d\n", n, offset);
+        failures++;
+      }
+
+      memset(out16, 0x55, sizeof(out16));
+      apply_lut_scalar(s8, out16[0], lut, n);
+      pixel_apply_lut(s8, out16[1], lut, n);
+      if (memcmp(out16[0], out16[1], sizeof(out16[0]))) {
+        printf("pixel_apply_lut failed for n=%d offset=%d\n", n, offset);
+        failures++;
+      }
+
+      memset(out8, 0x55, sizeof(out8));
+      scale_3_2_8_scalar(s8, out8[0], n);
+      pixel_scale_3_2_8(s8, out8[1], n);
+      if (memcmp(out8[0], out8[1], sizeof(out8[0]))) {
+        printf("pixel_scale_3_2_8 failed for n=%d offset=%d\n", n, offset);
+        failures++;
+      }
+
+      memset(out16, 0x55, sizeof(out16));
+      scale_3_2_16_scalar(s16, out16[0], n);
+      pixel_scale_3_2_16(s16, out16[1], n);
+      if (memcmp(out16[0], out16[1], sizeof(out16[0]))) {
+        printf("pixel_scale_3_2_16 failed for n=%d offset=%d\n", n, offset);
+        failures++;
+      }
+
+      memcpy(out16[0] + offset, s16, n * sizeof(uint16_t));
+      memcpy(out16[1] + offset, s16, n * sizeof(uint16_t));
+      bswap16_scalar(out16[0] + offset, n);
+      pixel_bswap16(out16[1] + offset, n);
+      if (memcmp(out16[0], out16[1], sizeof(out16[0]))) {
+        printf("pixel_bswap16 failed for n=%d offset=%d\n", n, offset);
+        failures++;
+      }
+    }
+  }
+
+  printf("pixel selftest (%s): %d failures\n", pixel_backend(), failures);
+  return failures;
+}
+
+#define BENCH_PIXELS 160
+#define BENCH_ROUNDS 2000
+
+#define BENCH(call)                                       \
+  do {                                                    \
+    uint32_t start = now_us();                            \
+    for (int r = 0; r < BENCH_ROUNDS; r++) {              \
+      call;                                               \
+      __asm__ __volatile__("" : : "r"(out8), "r"(out16) : "memory"); \
+    }                                                     \
+    elapsed = now_us() - start;                           \
+  } while (0)
+
+void pixel_bench(void) {
+  alignas(16) uint8_t src8[BENCH_PIXELS];
+  alignas(16) uint16_t src16[BENCH_PIXELS];
+  alignas(16) uint8_t out8[BENCH_PIXELS * 2];
+  alignas(16) uint16_t out16[BENCH_PIXELS * 2];
+  const uint16_t lut[4] = {0xFFFF, 0x8410, 0x4208, 0x0000};
+  uint32_t elapsed, scalar;
+
+  for (int i = 0; i < BENCH_PIXELS; i++) {
+    src8[i] = test_random();
+    src16[i] = test_random() << 8 | test_random();
+  }
+
+  printf("pixel bench (%s), %d rounds of %d pixels, us:\n", pixel_backend(),
+         BENCH_ROUNDS, BENCH_PIXELS);
+
+  BENCH(expand_2bpp_scalar(src8, out8, BENCH_PIXELS));
+  scalar = elapsed;
+  BENCH(pixel_expand_2bpp(src8, out8, BENCH_PIXELS));
+  printf("  expand_2bpp  %6u  scalar %6u\n", elapsed, scalar);
+
+  BENCH(apply_lut_scalar(src8, out16, lut, BENCH_PIXELS));
+  scalar = elapsed;
+  BENCH(pixel_apply_lut(src8, out16, lut, BENCH_PIXELS));
+  printf("  apply_lut    %6u  scalar %6u\n", elapsed, scalar);
+
+  BENCH(scale_3_2_8_scalar(src8, out8, BENCH_PIXELS));
+  scalar = elapsed;
+  BENCH(pixel_scale_3_2_8(src8, out8, BENCH_PIXELS));
+  printf("  scale_3_2_8  %6u  scalar %6u\n", elapsed, scalar);
+
+  BENCH(scale_3_2_16_scalar(src16, out16, BENCH_PIXELS));
+  scalar = elapsed;
+  BENCH(pixel_scale_3_2_16(src16, out16, BENCH_PIXELS));
+  printf("  scale_3_2_16 %6u  scalar %6u\n", elapsed, scalar);
+
+  BENCH(bswap16_scalar(out16, BENCH_PIXELS));
+  scalar = elapsed;
+  BENCH(pixel_bswap16(out16, BENCH_PIXELS));
+  printf("  bswap16      %6u  scalar %6u\n", elapsed, scalar);
+}
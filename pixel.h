@@ -0,0 +1,30 @@
+#ifndef PIXEL_H
+#define PIXEL_H
+#include <stdint.h>
+
+/*
+ * Pixel kernels used by the renderer and the display path. Each kernel has a
+ * scalar reference and, where available, a vector backend picked at compile
+ * time: SSE2/SSSE3/AVX2 on the host and 32-bit SWAR on the ESP32-S3
+ * (define PIXEL_FORCE_SWAR to build the SWAR backend on the host).
+ * Counts are in source pixels; vector backends fall back to scalar for tails.
+ */
+
+// Unpacks 2bpp pixels (first pixel in the top bits) into one byte each
+void pixel_expand_2bpp(const uint8_t *src, uint8_t *dst, int n);
+// Maps colour numbers 0-3 through a 4-entry RGB565 lookup table
+void pixel_apply_lut(const uint8_t *src, uint16_t *dst, const uint16_t *lut, int n);
+// Horizontal 3:2 expansion: even pixels are copied once, odd pixels twice
+void pixel_scale_3_2_8(const uint8_t *src, uint8_t *dst, int n);
+void pixel_scale_3_2_16(const uint16_t *src, uint16_t *dst, int n);
+// Swaps the bytes of each RGB565 pixel in place
+void pixel_bswap16(uint16_t *buf, int n);
+
+// Name of the backend selected at compile time
+const char *pixel_backend(void);
+// Checks every kernel and its scalar version against known answers, then
+// against each other on random data, returns number of failures
+int pixel_selftest(void);
+// Prints the time of every kernel and its scalar version on a 160-pixel line
+void pixel_bench(void);
+#endif
@@ -2,50 +2,29 @@
 #include "rom.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "romprovider.h"
+
+#ifndef BUILD_FOR_PC
+#include "esp_heap_caps.h"
+#endif
+
 const unsigned char *bytes;
 unsigned int mapper;
+static unsigned int ram_bank_mask;
+static const struct rom_provider *provider;
 
-extern "C" {
-
-static char *carts[] = {
-    /*
-          [0x00] = "ROM ONLY",
-          [0x01] = "MBC1",
-          [0x02] = "MBC1+RAM",
-          [0x03] = "MBC1+RAM+BATTERY",
-          [0x05] = "MBC2",
-          [0x06] = "MBC2+BATTERY",
-          [0x08] = "ROM+RAM",
-          [0x09] = "ROM+RAM+BATTERY",
-          [0x0B] = "MMM01",
-          [0x0C] = "MMM01+RAM",
-          [0x0D] = "MMM01+RAM+BATTERY",
-          [0x0F] = "MBC3+TIMER+BATTERY",
-          [0x10] = "MBC3+TIMER+RAM+BATTERY",
-          [0x11] = "MBC3",
-          [0x12] = "MBC3+RAM",
-          [0x13] = "MBC3+RAM+BATTERY",
-          [0x15] = "MBC4",
-          [0x16] = "MBC4+RAM",
-          [0x17] = "MBC4+RAM+BATTERY",
-          [0x19] = "MBC5",
-          [0x1A] = "MBC5+RAM",
-          [0x1B] = "MBC5+RAM+BATTERY",
-          [0x1C] = "MBC5+RUMBLE",
-          [0x1D] = "MBC5+RUMBLE+RAM",
-          [0x1E] = "MBC5+RUMBLE+RAM+BATTERY",
-          [0xFC] = "POCKET CAMERA",
-          [0xFD] = "BANDAI TAMA5",
-          [0xFE] = "HuC3",
-          [0xFF] = "HuC1+RAM+BATTERY",
-    */
-};
-}
+/* Copies of the hottest banks in internal SRAM, which mem_bank_switch()
+ * copies from much faster than from PSRAM or flash */
+static unsigned char *hot_copy[ROM_HOT_BANKS + 1];
+static int hot_bank[ROM_HOT_BANKS + 1]; /* Bank in each copy, -1 if none */
+static int hot_slots = -1;              /* Copies allocated, -1 before the first placement */
+static uint32_t hot_promotions;
 
 static const char *banks[] = {" 32KiB", " 64KiB", "128KiB", "256KiB", "512KiB",
-                              "  1MiB", "  2MiB", "  4MiB",
+                              "  1MiB", "  2MiB", "  4MiB", "  8MiB",
                               /* 0x52 */
                               "1.1MiB", "1.2MiB", "1.5MiB", "Unknown"};
 
@@ -59,7 +38,7 @@ static unsigned char header[] = {
     0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99, 0xBB, 0xBB, 0x67, 0x63,
     0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E};
 
-int rom_init(unsigned char *rombytes) {
+int rom_init(const unsigned char *rombytes) {
   char buf[17];
   int type, bank_index, ram, region, version, i, pass;
   unsigned char checksum = 0;
@@ -72,14 +51,12 @@ int rom_init(unsigned char *rombytes) {
 
   type = rombytes[0x147];
 
-  // printf("Cartridge type: %s (%02X)\n", carts[type], type);
-
   bank_index = rombytes[0x148];
   /* Adjust for the gap in the bank indicies */
   if (bank_index >= 0x52 && bank_index <= 0x54)
-    bank_index -= 74;
-  else if (bank_index > 7)
-    bank_index = 11;
+    bank_index -= 73;
+  else if (bank_index > 8)
+    bank_index = 12;
 
   printf("Rom size: %s\n", banks[bank_index]);
 
@@ -103,6 +80,8 @@ int rom_init(unsigned char *rombytes) {
   if (!pass) return 0;
 
   bytes = rombytes;
+  /* Rumble carts drive the motor with bit 3 of the RAM bank */
+  ram_bank_mask = type >= 0x1C && type <= 0x1E ? 0x07 : 0x0F;
 
   switch (type) {
     case 0x00:
@@ -150,45 +129,109 @@ int rom_init(unsigned char *rombytes) {
 
 unsigned int rom_get_mapper(void) { return mapper; }
 
+unsigned int rom_get_ram_bank_mask(void) { return ram_bank_mask; }
+
+static int use_provider(const struct rom_provider *p, const unsigned char *bank0) {
+  if (!rom_init(bank0)) {
+    p->close();
+    return 0;
+  }
+  printf("ROM provider: %s\n", p->name);
+  provider = p;
+  /* The copies are of the previous ROM */
+  for (int i = 0; i < hot_slots; i++) hot_bank[i] = -1;
+  return 1;
+}
+
 int rom_load(const char *filename) {
-  /*
-#ifdef _WIN32
-        HANDLE f, map;
-#else
-        int f;
-        size_t length;
-        struct stat st;
-#endif
-        unsigned char *bytes;
+  for (int i = 0; rom_providers[i]; i++) {
+    const unsigned char *bank0 = rom_providers[i]->open(filename);
+    /* A bad header is bad whatever provides it */
+    if (bank0) return use_provider(rom_providers[i], bank0);
+  }
+  return 0;
+}
 
-#ifdef _WIN32
-        f = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
-                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+int rom_load_from(const struct rom_provider *p, const char *filename) {
+  const unsigned char *bank0 = p->open(filename);
+  return bank0 ? use_provider(p, bank0) : 0;
+}
 
-        if(f == INVALID_HANDLE_VALUE)
-                return 0;
+const unsigned char *rom_getbytes(void) { return bytes; }
 
-        map = CreateFileMapping(f, NULL, PAGE_READONLY, 0, 0, NULL);
-        if(!map)
-                return 0;
+const unsigned char *rom_get_bank(unsigned int n) {
+  if (provider) {
+    /* Banks past the end of the ROM mirror the ones below, as on a cart */
+    n %= provider->get_banks();
+    for (int i = 0; i < hot_slots; i++)
+      if (hot_bank[i] == (int)n) return hot_copy[i];
+    return provider->get_bank(n);
+  }
+  return &bytes[n * 0x4000];
+}
 
-        bytes = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
-        if(!bytes)
-                return 0;
+static void alloc_hot_banks(void) {
+  for (hot_slots = 0; hot_slots < ROM_HOT_BANKS; hot_slots++) {
+#ifdef BUILD_FOR_PC
+    hot_copy[hot_slots] = (unsigned char *)malloc(0x4000);
 #else
-        f = open(filename, O_RDONLY);
-        if(f == -1)
-                return 0;
-        if(fstat(f, &st) == -1)
-                return 0;
-
-        bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f, 0);
-        if(!bytes)
-                return 0;
+    hot_copy[hot_slots] =
+        (unsigned char *)heap_caps_malloc(0x4000, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
 #endif
-*/
+    if (!hot_copy[hot_slots]) break;
+    hot_bank[hot_slots] = -1;
+  }
+  printf("%d hot banks in internal SRAM\n", hot_slots);
+}
 
-  // return rom_init(bytes);
+int rom_is_hot_bank(unsigned int n) {
+  for (int i = 0; i < hot_slots; i++)
+    if (hot_bank[i] == (int)n) return 1;
   return 0;
 }
-const unsigned char *rom_getbytes(void) { return bytes; }
+
+void rom_place_hot_banks(const uint32_t *heat, unsigned int n) {
+  int want[ROM_HOT_BANKS + 1];
+  int wanted = 0;
+
+  if (!provider) return;
+  if (hot_slots < 0) alloc_hot_banks();
+
+  /* Bank 0 never moves, it stays in mem */
+  unsigned int banks = provider->get_banks();
+  if (n > banks) n = banks;
+  while (wanted < hot_slots) {
+    int best = -1;
+    for (unsigned int b = 1; b < n; b++) {
+      if (!heat[b] || (best >= 0 && heat[b] <= heat[best])) continue;
+      int taken = 0;
+      for (int i = 0; i < wanted; i++) taken |= want[i] == (int)b;
+      if (!taken) best = b;
+    }
+    if (best < 0) break;
+    want[wanted++] = best;
+  }
+
+  /* Copy in the wanted banks that are not there yet, over the unwanted.
+   * This runs on the emulator's thread, so only banks the provider has in
+   * memory are taken, the others wait for a later placement rather than
+   * the card. */
+  for (int i = 0; i < wanted; i++) {
+    if (rom_is_hot_bank(want[i])) continue;
+    const unsigned char *src =
+        provider->peek_bank ? provider->peek_bank(want[i]) : provider->get_bank(want[i]);
+    if (!src) continue;
+    for (int j = 0; j < hot_slots; j++) {
+      int keep = 0;
+      for (int k = 0; k < wanted; k++) keep |= hot_bank[j] == want[k];
+      if (keep) continue;
+      hot_bank[j] = -1;
+      memcpy(hot_copy[j], src, 0x4000);
+      hot_bank[j] = want[i];
+      hot_promotions++;
+      break;
+    }
+  }
+}
+
+uint32_t rom_get_hot_promotions(void) { return hot_promotions; }
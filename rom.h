@@ -5,10 +5,33 @@
 extern "C" {
 
 #endif
+#include <stdint.h>
+
+struct rom_provider;
+
+/* Loads with the first of rom_providers that can, see romprovider.h */
 int rom_load(const char *);
-int rom_init(unsigned char *);
+int rom_load_from(const struct rom_provider *, const char *);
+/* For an image already in memory */
+int rom_init(const unsigned char *);
+/* Only bank 0 is in memory when streamed, use rom_get_bank() */
 const unsigned char *rom_getbytes(void);
+const unsigned char *rom_get_bank(unsigned int n);
 unsigned int rom_get_mapper(void);
+/* MBC5 RAM bank bits, without the rumble motor bit */
+unsigned int rom_get_ram_bank_mask(void);
+
+/* Banks copied to internal SRAM when they are switched to the most, 0
+ * disables. Only for ROMs loaded through a provider. */
+#ifndef ROM_HOT_BANKS
+#define ROM_HOT_BANKS 4
+#endif
+/* Copies the hottest banks of the heat map (see mem.h) to internal SRAM, of
+ * those the provider has in memory */
+void rom_place_hot_banks(const uint32_t *heat, unsigned int n);
+int rom_is_hot_bank(unsigned int n);
+/* Banks copied to internal SRAM so far */
+uint32_t rom_get_hot_promotions(void);
 
 enum {
   NROM,
@@ -0,0 +1,308 @@
+#include "romfile.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "loader.h"
+
+#ifdef BUILD_FOR_PC
+#include <chrono>
+#else
+#include <Arduino.h>
+#include "esp_heap_caps.h"
+#endif
+
+#define BANK_SIZE 0x4000
+// 8 MiB, the largest MBC5 ROM
+#define MAX_BANKS 512
+#define HEADER_SIZE 0x150
+#define BLOCKS_OFFSET (8 + HEADER_SIZE)
+
+// LZ4 block format limits: the last 5 bytes are literals and the last match
+// starts 12 bytes before the end at the latest
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define MIN_MATCH 4
+#define HASH_BITS 12
+
+static uint32_t stat_packed, stat_unpacked, stat_us;
+
+static uint32_t now_us(void) {
+#ifdef BUILD_FOR_PC
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return micros();
+#endif
+}
+
+static unsigned char *alloc_packed(size_t size) {
+#ifdef BUILD_FOR_PC
+  return (unsigned char *)malloc(size);
+#else
+  unsigned char *p = (unsigned char *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+  return p ? p : (unsigned char *)malloc(size);
+#endif
+}
+
+/* LZ4 */
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static unsigned char *put_length(unsigned char *op, size_t len) {
+  for (; len >= 255; len -= 255) *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+/* Greedy compressor. Returns the size, or 0 if it does not fit in cap. */
+static size_t lz4_pack(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+  static int32_t table[1 << HASH_BITS];
+  unsigned char *op = dst;
+  size_t anchor = 0, i = 0;
+
+  for (int k = 0; k < 1 << HASH_BITS; k++) table[k] = -1;
+  while (n > MATCH_LIMIT && i < n - MATCH_LIMIT) {
+    uint32_t h = (read32(&src[i]) * 2654435761u) >> (32 - HASH_BITS);
+    int32_t ref = table[h];
+    table[h] = i;
+    if (ref < 0 || i - ref > 0xFFFF || read32(&src[ref]) != read32(&src[i])) {
+      i++;
+      continue;
+    }
+    size_t len = MIN_MATCH;
+    while (i + len < n - LAST_LITERALS && src[ref + len] == src[i + len]) len++;
+
+    size_t lit = i - anchor;
+    if ((size_t)(op - dst) + lit + lit / 255 + len / 255 + 8 > cap) return 0;
+    unsigned char *token = op++;
+    *token = (lit < 15 ? lit : 15) << 4 | (len - MIN_MATCH < 15 ? len - MIN_MATCH : 15);
+    if (lit >= 15) op = put_length(op, lit - 15);
+    memcpy(op, &src[anchor], lit);
+    op += lit;
+    *op++ = (i - ref) & 0xFF;
+    *op++ = (i - ref) >> 8;
+    if (len - MIN_MATCH >= 15) op = put_length(op, len - MIN_MATCH - 15);
+    i += len;
+    anchor = i;
+  }
+
+  size_t lit = n - anchor;
+  if ((size_t)(op - dst) + lit + lit / 255 + 2 > cap) return 0;
+  *op++ = (lit < 15 ? lit : 15) << 4;
+  if (lit >= 15) op = put_length(op, lit - 15);
+  memcpy(op, &src[anchor], lit);
+  op += lit;
+  return op - dst;
+}
+
+static bool get_length(const unsigned char **ip, const unsigned char *end, size_t *len) {
+  unsigned char b;
+  do {
+    if (*ip >= end) return false;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+/* Decompresses exactly n bytes, checking every bound */
+static bool lz4_unpack(const unsigned char *src, size_t size, unsigned char *dst, size_t n) {
+  const unsigned char *ip = src, *end = src + size;
+  unsigned char *op = dst, *out_end = dst + n;
+
+  while (ip < end) {
+    unsigned char token = *ip++;
+    size_t lit = token >> 4;
+    if (lit == 15 && !get_length(&ip, end, &lit)) return false;
+    if (lit > (size_t)(end - ip) || lit > (size_t)(out_end - op)) return false;
+    memcpy(op, ip, lit);
+    ip += lit;
+    op += lit;
+    // The last sequence has no match
+    if (ip == end) break;
+
+    if (end - ip < 2) return false;
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t len = token & 15;
+    if (len == 15 && !get_length(&ip, end, &len)) return false;
+    len += MIN_MATCH;
+    if (!offset || offset > (size_t)(op - dst) || len > (size_t)(out_end - op)) return false;
+    // Byte by byte, the match may overlap what it copies
+    const unsigned char *match = op - offset;
+    while (len--) *op++ = *match++;
+  }
+  return op == out_end;
+}
+
+/* Files */
+
+bool rom_file_open(struct rom_file *rom, const char *path) {
+  char magic[4];
+  uint32_t banks;
+
+  memset(rom, 0, sizeof(*rom));
+  rom->file = loader_open(path, "rb");
+  if (!rom->file) {
+    printf("Error opening file: %s\n", path);
+    return false;
+  }
+  fseek(rom->file, 0, SEEK_END);
+  long size = ftell(rom->file);
+  fseek(rom->file, 0, SEEK_SET);
+
+  if (fread(magic, 1, 4, rom->file) != 4 || memcmp(magic, ROM_FILE_MAGIC, 4)) {
+    if (size < 2 * BANK_SIZE || size > MAX_BANKS * BANK_SIZE) {
+      printf("Unsupported ROM size: %ld bytes\n", size);
+      rom_file_close(rom);
+      return false;
+    }
+    rom->banks = size / BANK_SIZE;
+    return true;
+  }
+
+  if (fread(&banks, 4, 1, rom->file) != 1 || banks < 2 || banks > MAX_BANKS) {
+    printf("Unsupported ROM size: %u banks\n", banks);
+    rom_file_close(rom);
+    return false;
+  }
+  rom->banks = banks;
+  rom->blocks = (uint32_t *)malloc((banks + 1) * sizeof(*rom->blocks));
+  bool ok = rom->blocks && fseek(rom->file, BLOCKS_OFFSET, SEEK_SET) == 0 &&
+            fread(rom->blocks, sizeof(*rom->blocks), banks + 1, rom->file) == banks + 1;
+  for (unsigned int i = 0; ok && i < banks; i++) {
+    ok = rom->blocks[i] < rom->blocks[i + 1] && rom->blocks[i + 1] - rom->blocks[i] <= BANK_SIZE;
+  }
+  if (!ok || rom->blocks[banks] > (uint32_t)size) {
+    printf("Damaged compressed ROM: %s\n", path);
+    rom_file_close(rom);
+    return false;
+  }
+  return true;
+}
+
+void rom_file_close(struct rom_file *rom) {
+  if (rom->file) fclose(rom->file);
+  free(rom->blocks);
+  free(rom->packed);
+  memset(rom, 0, sizeof(*rom));
+}
+
+bool rom_file_read(struct rom_file *rom, unsigned int n, unsigned int count, unsigned char *dst) {
+  if (!rom->blocks) {
+    size_t size = (size_t)count * BANK_SIZE;
+    return loader_read(rom->file, (long)n * BANK_SIZE, dst, size) == size;
+  }
+
+  // One read for all the blocks, from a sector boundary
+  long start = rom->blocks[n] & ~511;
+  size_t size = rom->blocks[n + count] - start;
+  if (size > rom->packed_size) {
+    free(rom->packed);
+    rom->packed = alloc_packed(size);
+    rom->packed_size = rom->packed ? size : 0;
+    if (!rom->packed) return false;
+  }
+  if (!loader_read(rom->file, start, rom->packed, size)) return false;
+
+  uint32_t t = now_us();
+  for (unsigned int i = n; i < n + count; i++) {
+    const unsigned char *block = &rom->packed[rom->blocks[i] - start];
+    size_t len = rom->blocks[i + 1] - rom->blocks[i];
+    unsigned char *bank = &dst[(i - n) * BANK_SIZE];
+    if (len == BANK_SIZE) {
+      memcpy(bank, block, BANK_SIZE);
+    } else if (!lz4_unpack(block, len, bank, BANK_SIZE)) {
+      printf("Damaged block for bank %u\n", i);
+      return false;
+    }
+    stat_packed += len;
+  }
+  stat_unpacked += count * BANK_SIZE;
+  stat_us += now_us() - t;
+  return true;
+}
+
+bool rom_file_read_header(const char *path, unsigned char *header) {
+  unsigned char buf[BLOCKS_OFFSET];
+  FILE *f = fopen(path, "rb");
+
+  if (!f) return false;
+  size_t n = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  if (n >= 4 && !memcmp(buf, ROM_FILE_MAGIC, 4)) {
+    if (n != sizeof(buf)) return false;
+    memcpy(header, &buf[8], HEADER_SIZE);
+    return true;
+  }
+  if (n < HEADER_SIZE) return false;
+  memcpy(header, buf, HEADER_SIZE);
+  return true;
+}
+
+void rom_file_read_stats(struct rom_file_stats *stats) {
+  stats->packed = stat_packed;
+  stats->unpacked = stat_unpacked;
+  stats->us = stat_us;
+  stat_packed = stat_unpacked = stat_us = 0;
+}
+
+bool rom_file_compress(const char *src, const char *dst) {
+  struct rom_file rom;
+  uint32_t start = now_us();
+
+  if (!rom_file_open(&rom, src)) return false;
+  if (rom.blocks) {
+    printf("%s is compressed already\n", src);
+    rom_file_close(&rom);
+    return false;
+  }
+  uint32_t banks = rom.banks;
+  unsigned char *image = (unsigned char *)malloc(banks * BANK_SIZE);
+  unsigned char *block = (unsigned char *)malloc(BANK_SIZE);
+  uint32_t *blocks = (uint32_t *)malloc((banks + 1) * sizeof(*blocks));
+  FILE *f = NULL;
+  bool ok = image && block && blocks && rom_file_read(&rom, 0, banks, image) && (f = fopen(dst, "wb"));
+  rom_file_close(&rom);
+
+  if (ok) {
+    fwrite(ROM_FILE_MAGIC, 1, 4, f);
+    fwrite(&banks, 4, 1, f);
+    fwrite(image, 1, HEADER_SIZE, f);
+    blocks[0] = BLOCKS_OFFSET + (banks + 1) * sizeof(*blocks);
+    fseek(f, blocks[0], SEEK_SET);
+    for (uint32_t i = 0; i < banks; i++) {
+      const unsigned char *bank = &image[i * BANK_SIZE];
+      // Shorter than a bank, so a bank-sized block is always a stored one
+      size_t len = lz4_pack(bank, BANK_SIZE, block, BANK_SIZE - 1);
+      if (len) {
+        fwrite(block, 1, len, f);
+      } else {
+        len = BANK_SIZE;
+        fwrite(bank, 1, len, f);
+      }
+      blocks[i + 1] = blocks[i] + len;
+    }
+    fseek(f, BLOCKS_OFFSET, SEEK_SET);
+    fwrite(blocks, sizeof(*blocks), banks + 1, f);
+    ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+  }
+  if (ok) {
+    printf("Compressed %u banks: %u KiB to %u KiB (%u%%) in %u ms\n", banks, banks * 16,
+           blocks[banks] / 1024, (unsigned int)((uint64_t)blocks[banks] * 100 / (banks * BANK_SIZE)),
+           (now_us() - start) / 1000);
+  } else {
+    printf("Failed to compress %s to %s\n", src, dst);
+  }
+  free(image);
+  free(block);
+  free(blocks);
+  return ok;
+}
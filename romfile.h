@@ -0,0 +1,48 @@
+#ifndef ROMFILE_H
+#define ROMFILE_H
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * ROM files on the card, either a plain image (.gb) or compressed bank by
+ * bank (.gbz), so a compressed ROM can still be read one bank at a time.
+ *
+ * .gbz layout, integers little-endian:
+ *   0x000  ROM_FILE_MAGIC
+ *   0x004  number of 16 KiB banks
+ *   0x008  the first 0x150 bytes of the ROM, for the catalogue
+ *   0x158  offset of each bank's block in the file, then the end of the last
+ *   ...    the blocks, each an LZ4 block of one bank, or the bank itself when
+ *          it does not compress
+ * Write one with rom_file_compress(), e.g. "gameboy -z rom.gbz rom.gb".
+ */
+
+#define ROM_FILE_MAGIC "GBZ1"
+
+struct rom_file {
+  FILE *file;
+  unsigned int banks;
+  uint32_t *blocks;       // Block offsets, NULL for a plain image
+  unsigned char *packed;  // Blocks being decompressed
+  size_t packed_size;
+};
+
+struct rom_file_stats {
+  uint32_t packed, unpacked;  // Bytes decompressed from and to
+  uint32_t us;                // Time spent decompressing
+};
+
+// Opens a ROM of 2 to 512 banks, returns false with a message if it is not
+bool rom_file_open(struct rom_file *rom, const char *path);
+void rom_file_close(struct rom_file *rom);
+// Reads count banks from bank n on, returns false on error
+bool rom_file_read(struct rom_file *rom, unsigned int n, unsigned int count, unsigned char *dst);
+// Reads the first 0x150 bytes of the ROM in the file, compressed or not
+bool rom_file_read_header(const char *path, unsigned char *header);
+// Counters since the previous call
+void rom_file_read_stats(struct rom_file_stats *stats);
+
+// Writes the plain ROM at src to dst in the compressed format, returns false
+// on error
+bool rom_file_compress(const char *src, const char *dst);
+#endif
@@ -0,0 +1,431 @@
+#include "romprovider.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "bankcache.h"
+#include "romfile.h"
+
+#ifdef BUILD_FOR_PC
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+#else
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "esp_heap_caps.h"
+#include "esp_idf_version.h"
+#include "esp_partition.h"
+#if ESP_IDF_VERSION_MAJOR >= 5
+#define flash_munmap esp_partition_munmap
+#else
+#define flash_munmap spi_flash_munmap
+#endif
+#endif
+
+#define BANK_SIZE 0x4000
+// 8 MiB, the largest MBC5 ROM
+#define MAX_BANKS 512
+
+static uint32_t now_us(void) {
+#ifdef BUILD_FOR_PC
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return micros();
+#endif
+}
+
+// Lets another thread run for a moment
+static void wait_a_moment(void) {
+#ifdef BUILD_FOR_PC
+  std::this_thread::sleep_for(std::chrono::microseconds(100));
+#else
+  vTaskDelay(1);
+#endif
+}
+
+static uint32_t load_start;
+static std::atomic<uint32_t> load_us;
+
+static void load_begin(void) {
+  load_start = now_us();
+  load_us = 0;
+}
+
+static void load_done(void) { load_us = now_us() - load_start; }
+
+/* Whole image in memory, shared by mmap, flash and copy */
+
+static const unsigned char *image;
+static unsigned int image_banks;
+
+static const unsigned char *image_get_bank(unsigned int n) { return &image[n * BANK_SIZE]; }
+
+static unsigned int image_get_banks(void) { return image_banks; }
+
+/* mmap */
+
+#ifdef BUILD_FOR_PC
+static const unsigned char *mmap_open(const char *path) {
+  struct stat st;
+  load_begin();
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1) return NULL;
+  if (fstat(fd, &st) == -1 || st.st_size < 2 * BANK_SIZE || st.st_size > MAX_BANKS * BANK_SIZE) {
+    close(fd);
+    return NULL;
+  }
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file open
+  close(fd);
+  if (p == MAP_FAILED) return NULL;
+  // A compressed ROM is left to the copy provider
+  if (!memcmp(p, ROM_FILE_MAGIC, 4)) {
+    munmap(p, st.st_size);
+    return NULL;
+  }
+
+  image = (const unsigned char *)p;
+  image_banks = st.st_size / BANK_SIZE;
+  load_done();
+  return image;
+}
+
+static void mmap_close(void) {
+  munmap((void *)image, image_banks * BANK_SIZE);
+  image = NULL;
+}
+#else
+static const unsigned char *mmap_open(const char *path) { return NULL; }
+
+static void mmap_close(void) {}
+#endif
+
+const struct rom_provider rom_provider_mmap = {"mmap", mmap_open, mmap_close, image_get_bank,
+                                               image_get_banks, NULL};
+
+/* Flash partition */
+
+#ifndef BUILD_FOR_PC
+static const esp_partition_t *partition;
+static spi_flash_mmap_handle_t flash_map;
+
+static const unsigned char *flash_map_banks(unsigned int banks) {
+  const void *p;
+  if (esp_partition_mmap(partition, 0, banks * BANK_SIZE, ESP_PARTITION_MMAP_DATA, &p,
+                         &flash_map) != ESP_OK)
+    return NULL;
+  return (const unsigned char *)p;
+}
+
+/* Kept in the last sector of the partition and written after every bank,
+ * so the partition holds a ROM only when its marker matches the file. The
+ * hash is over the banks rather than the file, a .gb and a .gbz of the same
+ * ROM share an install. */
+#define FLASH_MAGIC "GBRF"
+
+struct flash_marker {
+  char magic[4];
+  uint32_t banks;
+  uint32_t hash;  // FNV-1a of every bank
+};
+
+static size_t flash_marker_offset(void) { return partition->size - SPI_FLASH_SEC_SIZE; }
+
+static uint32_t hash_bank(uint32_t h, const unsigned char *p) {
+  for (int i = 0; i < BANK_SIZE; i++) h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+// Reads every bank of the file through buf
+static bool flash_hash_file(struct rom_file *rom, unsigned int banks, unsigned char *buf,
+                            struct flash_marker *m) {
+  memcpy(m->magic, FLASH_MAGIC, 4);
+  m->banks = banks;
+  m->hash = 2166136261u;
+  for (unsigned int n = 0; n < banks; n++) {
+    if (!rom_file_read(rom, n, 1, buf)) return false;
+    m->hash = hash_bank(m->hash, buf);
+  }
+  return true;
+}
+
+/* Copies the file to the partition. The marker is erased first and written
+ * last, so an interrupted install never matches and is redone. */
+static bool flash_install(struct rom_file *rom, unsigned int banks, unsigned char *buf) {
+  uint32_t start = now_us();
+  struct flash_marker m = {{0}, banks, 2166136261u};
+
+  printf("Installing ROM to flash partition \"%s\"\n", partition->label);
+  memcpy(m.magic, FLASH_MAGIC, 4);
+  if (esp_partition_erase_range(partition, flash_marker_offset(), SPI_FLASH_SEC_SIZE) != ESP_OK)
+    return false;
+  size_t size = (banks * BANK_SIZE + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+  if (esp_partition_erase_range(partition, 0, size) != ESP_OK) return false;
+  for (unsigned int n = 0; n < banks; n++) {
+    if (!rom_file_read(rom, n, 1, buf)) return false;
+    if (esp_partition_write(partition, n * BANK_SIZE, buf, BANK_SIZE) != ESP_OK) return false;
+    m.hash = hash_bank(m.hash, buf);
+  }
+  if (esp_partition_write(partition, flash_marker_offset(), &m, sizeof(m)) != ESP_OK) return false;
+  printf("Installed %u banks in %u ms\n", banks, (now_us() - start) / 1000);
+  return true;
+}
+
+static const unsigned char *flash_open(const char *path) {
+  load_begin();
+  partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "rom");
+  if (!partition) return NULL;
+
+  struct rom_file rom;
+  if (!rom_file_open(&rom, path)) return NULL;
+  unsigned int banks = rom.banks;
+  unsigned char *buf = (unsigned char *)malloc(BANK_SIZE);
+  const unsigned char *p = NULL;
+
+  // The banks and the marker's sector
+  if (banks * BANK_SIZE <= flash_marker_offset() && buf) {
+    struct flash_marker want, have;
+    uint32_t start = now_us();
+    // Installed already if the marker matches, see flash_install()
+    bool installed = flash_hash_file(&rom, banks, buf, &want) &&
+                     esp_partition_read(partition, flash_marker_offset(), &have, sizeof(have)) == ESP_OK &&
+                     !memcmp(&want, &have, sizeof(want));
+    printf("Checked ROM in flash in %u ms, %s\n", (now_us() - start) / 1000,
+           installed ? "installed" : "different");
+    if (installed || flash_install(&rom, banks, buf)) p = flash_map_banks(banks);
+  }
+  free(buf);
+  rom_file_close(&rom);
+  if (!p) return NULL;
+
+  image = p;
+  image_banks = banks;
+  load_done();
+  return image;
+}
+
+static void flash_close(void) {
+  flash_munmap(flash_map);
+  image = NULL;
+}
+#else
+static const unsigned char *flash_open(const char *path) { return NULL; }
+
+static void flash_close(void) {}
+#endif
+
+const struct rom_provider rom_provider_flash = {"flash", flash_open, flash_close, image_get_bank,
+                                                image_get_banks, NULL};
+
+/* Copy in PSRAM. Banks 0 and 1 are read before the game starts, the rest
+ * by a background loader in order. A bank that is not in yet is waited for,
+ * with the loader raised above the emulator until it arrives. */
+
+static struct rom_file copy_rom;
+static std::atomic<unsigned int> copy_loaded;  // Banks read so far
+static std::atomic<bool> copy_stop, copy_running;
+static std::atomic<int> copy_boost;  // Priority the loader should run at, 0 for its own
+static uint32_t copy_wait_us;
+
+// Banks per read of the background loader
+#define COPY_SPAN 8
+
+static unsigned char *copy_alloc(size_t size) {
+#ifdef BUILD_FOR_PC
+  return (unsigned char *)malloc(size);
+#else
+  return (unsigned char *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+#endif
+}
+
+static void copy_loader(void *arg) {
+  unsigned char *p = (unsigned char *)image;
+
+  for (unsigned int n = copy_loaded; n < image_banks && !copy_stop; n += COPY_SPAN) {
+    unsigned int span = image_banks - n < COPY_SPAN ? image_banks - n : COPY_SPAN;
+#ifndef BUILD_FOR_PC
+    // The loader's worker takes this priority for the span
+    int boost = copy_boost;
+    vTaskPrioritySet(NULL, boost ? boost : ROM_LOADER_PRIORITY);
+#endif
+    if (!rom_file_read(&copy_rom, n, span, &p[n * BANK_SIZE])) {
+      printf("Failed to read banks %u-%u\n", n, n + span - 1);
+      memset(&p[n * BANK_SIZE], 0xFF, span * BANK_SIZE);
+    }
+    copy_loaded.store(n + span, std::memory_order_release);
+  }
+  if (!copy_stop) load_done();
+  rom_file_close(&copy_rom);
+  copy_running = false;
+#ifndef BUILD_FOR_PC
+  vTaskDelete(NULL);
+#endif
+}
+
+static const unsigned char *copy_open(const char *path) {
+  load_begin();
+  struct rom_file rom;
+  if (!rom_file_open(&rom, path)) return NULL;
+
+  unsigned int banks = rom.banks;
+  unsigned char *p = copy_alloc(banks * BANK_SIZE);
+  if (!p || !rom_file_read(&rom, 0, 2, p)) {
+    free(p);
+    rom_file_close(&rom);
+    return NULL;
+  }
+
+  image = p;
+  image_banks = banks;
+  copy_rom = rom;
+  copy_loaded = 2;
+  copy_stop = false;
+  copy_boost = 0;
+  copy_wait_us = 0;
+  copy_running = true;
+#ifdef BUILD_FOR_PC
+  std::thread(copy_loader, (void *)NULL).detach();
+#else
+  xTaskCreatePinnedToCore(copy_loader, "romLoader", 4096, NULL, ROM_LOADER_PRIORITY, NULL, 0);
+#endif
+  return image;
+}
+
+static const unsigned char *copy_get_bank(unsigned int n) {
+  if (n >= copy_loaded.load(std::memory_order_acquire)) {
+    uint32_t start = now_us();
+#ifndef BUILD_FOR_PC
+    copy_boost = uxTaskPriorityGet(NULL) + 1;
+#endif
+    while (n >= copy_loaded.load(std::memory_order_acquire)) wait_a_moment();
+    copy_boost = 0;
+    copy_wait_us += now_us() - start;
+  }
+  return &image[n * BANK_SIZE];
+}
+
+static const unsigned char *copy_peek_bank(unsigned int n) {
+  return n < copy_loaded.load(std::memory_order_acquire) ? &image[n * BANK_SIZE] : NULL;
+}
+
+static void copy_close(void) {
+  copy_stop = true;
+  while (copy_running) wait_a_moment();
+  free((void *)image);
+  image = NULL;
+}
+
+const struct rom_provider rom_provider_copy = {"copy", copy_open, copy_close, copy_get_bank,
+                                               image_get_banks, copy_peek_bank};
+
+/* Streamed */
+
+static const unsigned char *stream_open(const char *path) {
+  load_begin();
+  const unsigned char *bank0 = bank_cache_open(path, ROM_BANK_POOL);
+  if (bank0) load_done();
+  return bank0;
+}
+
+const struct rom_provider rom_provider_stream = {"stream", stream_open, bank_cache_close, bank_cache_get,
+                                                 bank_cache_get_banks, bank_cache_peek};
+
+const struct rom_provider *const rom_providers[] = {
+#ifdef BUILD_FOR_PC
+    &rom_provider_mmap,
+#else
+    &rom_provider_flash,
+#endif
+    &rom_provider_copy, &rom_provider_stream, NULL};
+
+uint32_t rom_provider_load_us(void) { return load_us; }
+
+uint32_t rom_provider_wait_us(void) { return copy_wait_us; }
+
+/* Benchmark */
+
+#define BENCH_SWITCHES 1000
+
+static unsigned char *alloc_internal(size_t size) {
+#ifdef BUILD_FOR_PC
+  return (unsigned char *)malloc(size);
+#else
+  return (unsigned char *)heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+#endif
+}
+
+// The work of mem_bank_switch(), a copy of the selected bank into mem, which
+// is in internal SRAM. Returns the average in us.
+static float time_switches(const unsigned char *(*get_bank)(unsigned int), unsigned int banks,
+                           unsigned char *dst) {
+  uint32_t seed = 1;
+  uint32_t start = now_us();
+  for (int j = 0; j < BENCH_SWITCHES; j++) {
+    seed = seed * 1103515245 + 12345;
+    memcpy(dst, get_bank(1 + (seed >> 16) % (banks - 1)), BANK_SIZE);
+    // Keeps the unused copy from being optimised away
+    __asm__ __volatile__("" : : "r"(dst) : "memory");
+  }
+  return (float)(now_us() - start) / BENCH_SWITCHES;
+}
+
+static unsigned char *sram_bank;
+
+static const unsigned char *sram_get_bank(unsigned int n) { return sram_bank; }
+
+void rom_provider_bench(const char *path) {
+  unsigned char *scratch = alloc_internal(BANK_SIZE);
+  sram_bank = alloc_internal(BANK_SIZE);
+
+  if (!scratch || !sram_bank) {
+    free(scratch);
+    free(sram_bank);
+    return;
+  }
+  printf("rom bench, %d random bank switches:\n", BENCH_SWITCHES);
+  struct rom_file_stats unpack;
+  rom_file_read_stats(&unpack);
+  for (int i = 0; rom_providers[i]; i++) {
+    const struct rom_provider *p = rom_providers[i];
+
+    uint32_t start = now_us();
+    if (!p->open(path)) {
+      printf("  %-6s unavailable\n", p->name);
+      continue;
+    }
+    uint32_t open_us = now_us() - start;
+    unsigned int banks = p->get_banks();
+    // Waits for a background load to finish
+    p->get_bank(banks - 1);
+    uint32_t ready_us = now_us() - start;
+
+    float switch_us = time_switches(p->get_bank, banks, scratch);
+    p->close();
+
+    printf("  %-6s open %8u us  ready %8u us  switch %6.1f us\n", p->name, open_us, ready_us,
+           switch_us);
+    // Decompression in the load and the switches
+    rom_file_read_stats(&unpack);
+    if (unpack.unpacked) {
+      printf("  %-6s unpacked %u KiB from %u KiB, %u us, %.1f MB/s\n", "", unpack.unpacked / 1024,
+             unpack.packed / 1024, unpack.us, unpack.us ? (float)unpack.unpacked / unpack.us : 0.0f);
+    }
+  }
+  // A hot bank, see ROM_HOT_BANKS in rom.h
+  memset(sram_bank, 0, BANK_SIZE);
+  printf("  %-6s %43s %6.1f us\n", "sram", "switch", time_switches(sram_get_bank, 2, scratch));
+  free(scratch);
+  free(sram_bank);
+}
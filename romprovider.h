@@ -0,0 +1,55 @@
+#ifndef ROMPROVIDER_H
+#define ROMPROVIDER_H
+#include <stdint.h>
+
+/*
+ * Where the ROM image lives. A provider makes the file at a path available
+ * and hands out its 16 KiB banks; rom_load() tries rom_providers in order and
+ * keeps the first that opens the file. All but mmap take compressed ROMs too
+ * (see romfile.h) and hand out the banks decompressed.
+ *
+ *   mmap    maps the file, zero-copy (host only)
+ *   flash   runs the ROM in place from a data partition named "rom", which
+ *           is rewritten when a different ROM is selected (device only, add
+ *           e.g. "rom, data, 0x40, , 4100K," to partitions.csv, the largest
+ *           ROM plus a 4 KiB sector that marks what is installed)
+ *   copy    reads the whole file into PSRAM, banks 0 and 1 before the game
+ *           starts and the rest in the background
+ *   stream  reads banks on demand into a small pool, see bankcache.h
+ */
+
+// Priority of the background loader of the copy provider
+#ifndef ROM_LOADER_PRIORITY
+#define ROM_LOADER_PRIORITY 0
+#endif
+
+struct rom_provider {
+  const char *name;
+  // Returns bank 0, or NULL if the ROM cannot be provided this way
+  const unsigned char *(*open)(const char *path);
+  void (*close)(void);
+  // Bank n, below get_banks()
+  const unsigned char *(*get_bank)(unsigned int n);
+  unsigned int (*get_banks)(void);
+  // Bank n if it is in memory already, else NULL without reading or
+  // waiting for it. NULL when every bank is in memory once open.
+  const unsigned char *(*peek_bank)(unsigned int n);
+};
+
+extern const struct rom_provider rom_provider_mmap;
+extern const struct rom_provider rom_provider_flash;
+extern const struct rom_provider rom_provider_copy;
+extern const struct rom_provider rom_provider_stream;
+
+// Providers available on this build, in order of preference, NULL terminated
+extern const struct rom_provider *const rom_providers[];
+
+// Time from opening the ROM to all of it being available, 0 while loading
+uint32_t rom_provider_load_us(void);
+// Time the emulator spent waiting for banks that were not loaded yet
+uint32_t rom_provider_wait_us(void);
+
+// Prints the open time and bank switch cost of every provider for the file,
+// call before rom_load() as the providers keep one ROM open at a time
+void rom_provider_bench(const char *path);
+#endif
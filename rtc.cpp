@@ -0,0 +1,166 @@
+#include "rtc.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "state.h"
+
+#ifdef BUILD_FOR_PC
+#include <chrono>
+#else
+#include "esp_timer.h"
+#endif
+
+enum { SECONDS, MINUTES, HOURS, DAY_LOW, DAY_HIGH, REGS };
+
+// Day high register
+#define DAY_BIT_8 0x01
+#define HALT 0x40
+#define CARRY 0x80
+
+static const uint8_t masks[REGS] = {0x3F, 0x3F, 0x1F, 0xFF, 0xC1};
+
+static bool present;
+static uint8_t base[REGS];  // The registers at base_time
+static int64_t base_time;   // Unix time
+static uint8_t latched[REGS];
+static uint8_t latch_last = 0xFF;
+
+// Without a set wall clock, the time since boot plus this stands in for it
+static bool wall_clock;
+static int64_t uptime_base;
+
+/* Saved for snapshots */
+#define RTC_STATE(X) X(base) X(base_time) X(latched) X(latch_last)
+
+#ifdef BUILD_FOR_PC
+static bool fake;
+static int64_t fake_wall, fake_uptime;
+
+void rtc_fake_clock(int64_t wall, int64_t uptime) {
+  fake = true;
+  fake_wall = wall;
+  fake_uptime = uptime;
+}
+
+static int64_t wall_s(void) { return fake ? fake_wall : (int64_t)time(NULL); }
+
+static int64_t uptime_s(void) {
+  if (fake) return fake_uptime;
+  return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#else
+static int64_t wall_s(void) { return (int64_t)time(NULL); }
+
+static int64_t uptime_s(void) { return esp_timer_get_time() / 1000000; }
+#endif
+
+static int64_t now_s(void) { return wall_clock ? wall_s() : uptime_base + uptime_s(); }
+
+/* The registers now. Out of range values the game wrote carry over like
+ * the rest, where a cart would count on to 63 first. */
+static void current(uint8_t *r) {
+  int64_t elapsed = now_s() - base_time;
+
+  memcpy(r, base, REGS);
+  // A clock set back on the host stands still until it catches up
+  if (base[DAY_HIGH] & HALT || elapsed <= 0) return;
+  uint64_t t = base[SECONDS] + (uint64_t)elapsed;
+  r[SECONDS] = t % 60;
+  t = t / 60 + base[MINUTES];
+  r[MINUTES] = t % 60;
+  t = t / 60 + base[HOURS];
+  r[HOURS] = t % 24;
+  t = t / 24 + (base[DAY_LOW] | (base[DAY_HIGH] & DAY_BIT_8) << 8);
+  r[DAY_LOW] = t & 0xFF;
+  r[DAY_HIGH] = (base[DAY_HIGH] & (HALT | CARRY)) | (t >> 8 & DAY_BIT_8) | (t > 0x1FF ? CARRY : 0);
+}
+
+static void reset(void) {
+  memset(base, 0, sizeof(base));
+  memset(latched, 0, sizeof(latched));
+  base_time = now_s();
+  latch_last = 0xFF;
+}
+
+void rtc_init(unsigned char cart_type) {
+  present = cart_type == 0x0F || cart_type == 0x10;
+  wall_clock = wall_s() >= RTC_WALL_CLOCK_SET;
+  uptime_base = RTC_WALL_CLOCK_SET - uptime_s();
+  reset();
+}
+
+bool rtc_present(void) { return present; }
+
+unsigned char rtc_read(unsigned int reg) {
+  return reg >= 0x08 && reg < 0x08 + REGS ? latched[reg - 0x08] : 0xFF;
+}
+
+void rtc_write(unsigned int reg, unsigned char v) {
+  if (!present || reg < 0x08 || reg >= 0x08 + REGS) return;
+  // Counts up to now, so the other registers keep their time
+  current(base);
+  base_time = now_s();
+  base[reg - 0x08] = v & masks[reg - 0x08];
+  // Read back without a latch in between, as games check what they set
+  latched[reg - 0x08] = base[reg - 0x08];
+}
+
+void rtc_latch(unsigned char v) {
+  if (present && latch_last == 0 && v == 1) current(latched);
+  latch_last = v;
+}
+
+/* .sav footer */
+
+static void put32(uint8_t *p, uint32_t v) {
+  for (int i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+
+static uint32_t get32(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+
+void rtc_save_footer(uint8_t *p) {
+  for (int i = 0; i < REGS; i++) {
+    put32(&p[i * 4], base[i]);
+    put32(&p[20 + i * 4], latched[i]);
+  }
+  put32(&p[40], (uint64_t)base_time);
+  put32(&p[44], (uint64_t)base_time >> 32);
+}
+
+bool rtc_footer_due(void) {
+  if (!present || wall_clock || now_s() - base_time < RTC_FOOTER_REFRESH_S) return false;
+  current(base);
+  base_time = now_s();
+  return true;
+}
+
+void rtc_load_footer(const uint8_t *p, size_t len) {
+  reset();
+  if (len < 44) return;
+  for (int i = 0; i < REGS; i++) {
+    base[i] = get32(&p[i * 4]) & masks[i];
+    latched[i] = get32(&p[20 + i * 4]) & masks[i];
+  }
+  int64_t t = get32(&p[40]);
+  if (len >= RTC_FOOTER_SIZE) t |= (int64_t)get32(&p[44]) << 32;
+  // Saved by a clock that was not set, the time since is unknown
+  if (t < RTC_WALL_CLOCK_SET) return;
+  // Without a wall clock, no time passes while the power is off
+  if (!wall_clock) uptime_base = t - uptime_s();
+  base_time = t;
+}
+
+/* Snapshots */
+
+size_t rtc_state_size(void) { return 0 RTC_STATE(STATE_SIZE); }
+
+uint8_t *rtc_save_state(uint8_t *p) {
+  RTC_STATE(STATE_SAVE)
+  return p;
+}
+
+const uint8_t *rtc_load_state(const uint8_t *p) {
+  RTC_STATE(STATE_LOAD)
+  return p;
+}
@@ -0,0 +1,63 @@
+#ifndef RTC_H
+#define RTC_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * MBC3 real-time clock. Nothing ticks: the clock is kept as the registers
+ * at a base time, and the time elapsed since then on the host clock is only
+ * added when the game latches the registers. Writing a register, or
+ * stopping the clock with the halt bit, moves the base to now.
+ *
+ * The .sav footer is the layout most emulators share, integers
+ * little-endian: the registers (seconds, minutes, hours, day low, day high)
+ * as 4 bytes each, the latched ones likewise, then the time they were
+ * taken as a 64-bit Unix time. The registers at the base time are saved,
+ * so the footer stays valid until the game writes the clock again. Files
+ * with a 32-bit time (44 bytes) are read too.
+ *
+ * The device has no battery-backed clock of its own. Until its system time
+ * is set, the clock runs on the time since boot from the time in the
+ * footer, so it stands still while the power is off, and the footer keeps
+ * a time after RTC_WALL_CLOCK_SET rather than one from 1970. The footer is
+ * then also saved while the clock runs, see rtc_footer_due().
+ */
+
+#define RTC_FOOTER_SIZE 48
+
+// A wall clock before this (2024-01-01) is taken as not set
+#define RTC_WALL_CLOCK_SET 1704067200
+
+#ifndef RTC_FOOTER_REFRESH_S
+#define RTC_FOOTER_REFRESH_S 60
+#endif
+
+// Whether the loaded cart has a clock, from its type byte
+void rtc_init(unsigned char cart_type);
+bool rtc_present(void);
+
+// reg is the register select value, 0x08-0x0C
+unsigned char rtc_read(unsigned int reg);
+void rtc_write(unsigned int reg, unsigned char v);
+// A write to 0x6000-0x7FFF, the registers are latched on 0 then 1
+void rtc_latch(unsigned char v);
+
+void rtc_save_footer(uint8_t *p);
+// Without a set wall clock the footer's time is all the next boot knows, so
+// this is true every RTC_FOOTER_REFRESH_S seconds, when the footer should be
+// saved again. Moves the base time to now.
+bool rtc_footer_due(void);
+// len is the number of footer bytes in the file, a short footer resets the
+// clock
+void rtc_load_footer(const uint8_t *p, size_t len);
+
+#ifdef BUILD_FOR_PC
+// Replaces the wall clock and the time since boot, in seconds, until the
+// next call
+void rtc_fake_clock(int64_t wall, int64_t uptime);
+#endif
+
+size_t rtc_state_size(void);
+uint8_t *rtc_save_state(uint8_t *p);
+const uint8_t *rtc_load_state(const uint8_t *p);
+#endif
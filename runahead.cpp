@@ -0,0 +1,84 @@
+#include "runahead.h"
+
+#include <stdio.h>
+
+#include "lcd.h"
+#include "mem.h"
+#include "state.h"
+
+#ifdef BUILD_FOR_PC
+#include <chrono>
+#else
+#include <Arduino.h>
+#endif
+
+static uint8_t *snapshot;
+static int ahead_frames;  // Configured
+static int ahead;         // For the current frame, 0 while not rendering
+static int pass;          // Frames emulated so far in the current frame
+static uint32_t ahead_start;
+
+static uint32_t stat_frames;
+static uint32_t stat_snapshot_us;
+static uint32_t stat_ahead_us;
+
+static uint32_t now_us(void) {
+#ifdef BUILD_FOR_PC
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return micros();
+#endif
+}
+
+void runahead_init(int frames) {
+  ahead_frames = frames;
+  if (frames && !snapshot) {
+    snapshot = state_alloc();
+    if (!snapshot) {
+      printf("Run-ahead disabled, no memory for a %u byte snapshot\n", (unsigned)state_size());
+      ahead_frames = 0;
+    }
+  }
+}
+
+int runahead_get_frames(void) { return ahead_frames; }
+
+void runahead_begin(bool render) {
+  ahead = render ? ahead_frames : 0;
+  pass = 0;
+  // Only the last frame is drawn
+  lcd_set_render_enabled(render && !ahead);
+}
+
+bool runahead_next(void) {
+  if (pass == 0) {
+    if (!ahead) return false;
+    uint32_t t = now_us();
+    state_save(snapshot);
+    mem_joypad_set_ahead(true);
+    ahead_start = now_us();
+    stat_snapshot_us += ahead_start - t;
+  }
+
+  if (pass++ < ahead) {
+    lcd_set_render_enabled(pass == ahead);
+    return true;
+  }
+
+  uint32_t t = now_us();
+  stat_ahead_us += t - ahead_start;
+  state_load(snapshot);
+  mem_joypad_set_ahead(false);
+  stat_snapshot_us += now_us() - t;
+  stat_frames++;
+  return false;
+}
+
+void runahead_read_stats(struct runahead_stats *stats) {
+  stats->frames = stat_frames;
+  stats->snapshot_us = stat_snapshot_us;
+  stats->ahead_us = stat_ahead_us;
+  stat_frames = stat_snapshot_us = stat_ahead_us = 0;
+}
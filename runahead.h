@@ -0,0 +1,40 @@
+#ifndef RUNAHEAD_H
+#define RUNAHEAD_H
+#include <stdint.h>
+
+/*
+ * Run-ahead hides the game's own input lag. Every rendered frame is first
+ * emulated for real without drawing, then the state is saved, the next
+ * frames are emulated with the same input and only the last of them is
+ * drawn and presented, and the state is restored. The picture is that many
+ * frames ahead of the game, at the cost of emulating each frame that many
+ * extra times plus a snapshot save and load (see state.h). Frames the pacer
+ * skips are emulated once, without running ahead.
+ *
+ *   runahead_begin(render);
+ *   do {
+ *     ... emulate until lcd_cycle() returns true ...
+ *   } while (runahead_next());
+ */
+
+// Frames to run ahead by default, 0 disables run-ahead
+#ifndef RUN_AHEAD_FRAMES
+#define RUN_AHEAD_FRAMES 0
+#endif
+
+struct runahead_stats {
+  uint32_t frames;       // Frames that ran ahead
+  uint32_t snapshot_us;  // Time spent saving and restoring state
+  uint32_t ahead_us;     // Time spent emulating the frames ahead
+};
+
+// Call after the emulator is initialised, allocates the snapshot
+void runahead_init(int frames);
+int runahead_get_frames(void);
+// Starts a frame, render is what pacer_frame_begin() returned
+void runahead_begin(bool render);
+// Ends an emulated frame, returns true if another one has to be emulated
+bool runahead_next(void);
+// Counters since the previous call
+void runahead_read_stats(struct runahead_stats *stats);
+#endif
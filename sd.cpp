@@ -1,4 +1,5 @@
 #include "sd.h"
+#include "loader.h"
 #include "sdl.h"
 #include <Arduino.h>
 
@@ -83,53 +84,8 @@ void sd_init() {
   sdmmc_card_print_info(stdout, card);
 }
 
-#include <dirent.h>
 #include <stdio.h>
 
-/**
- * @brief Lists all files with a ".gb" extension in the root of the SD card.
- * 
- * This function scans the SD card directory for files with the ".gb" extension
- * (typically Game Boy ROMs) and stores their names in an array.
- * 
- * @param file_list An array to store the filenames of matching files.
- * @param file_count Pointer to an integer to store the number of matching files found.
- * @return true if the directory was successfully read, false otherwise.
- */
-bool sd_list_files(char file_list[MAX_FILES][MAX_FILENAME_LEN], int *file_count) {
-  const char *base_path = "/sdcard"; // Root directory of the SD card
-  DIR *dir = opendir(base_path);    // Open the directory
-  *file_count = 0;                  // Initialize file count
-
-  if (dir == NULL) {
-    printf("Failed to open directory: %s\n", base_path);
-    return false; // Directory not accessible or SD card not mounted
-  }
-
-  struct dirent *entry;
-  printf("Listing files in %s:\n", base_path);
-
-  // Iterate through directory entries
-  while ((entry = readdir(dir)) != NULL) {
-    // Check if the entry is a regular file
-    if (entry->d_type == DT_REG) {
-      const char *file_name = entry->d_name;
-      const char *ext = strrchr(file_name, '.'); // Find the last dot in the filename
-
-      // Check if the file has a ".gb" extension
-      if (ext != NULL && strcmp(ext, ".gb") == 0) {
-        // Copy the filename to the output list
-        strncpy(file_list[*file_count], file_name, MAX_FILENAME_LEN - 1);
-        file_list[*file_count][MAX_FILENAME_LEN - 1] = '\0'; // Ensure null termination
-        (*file_count)++; // Increment the count of files
-      }
-    }
-  }
-
-  closedir(dir); // Close the directory
-  return true;   // Successfully listed files
-}
-
 /**
  * @brief Reads the contents of a file from the SD card into memory.
  * 
@@ -148,8 +104,8 @@ unsigned char *sd_read_file(const char *file_name) {
 
   printf("File path: %s\n", full_path); // Debug output of the file path
 
-  // Open the file in binary read mode
-  FILE *file = fopen(full_path, "rb");
+  // Open the file in binary read mode, unbuffered for the loader
+  FILE *file = loader_open(full_path, "rb");
   if (file == NULL) {
     printf("Error opening file: %s\n", full_path);
     return NULL; // Return NULL if the file cannot be opened
@@ -190,8 +146,8 @@ unsigned char *sd_read_file(const char *file_name) {
   printf("Memory allocation successful.\n");
   printf("Remaining memory after allocation: %d bytes\n", heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
 
-  // Read the file contents into the buffer
-  size_t bytes_read = fread(buffer, 1, file_size, file);
+  // Read the file contents into the buffer, in large double-buffered chunks
+  size_t bytes_read = loader_read(file, 0, buffer, file_size);
   if (bytes_read != file_size) {
     printf("Failed to read the entire file (read: %zu, expected: %ld).\n", bytes_read, file_size);
     free(buffer); // Free allocated memory on failure
@@ -1,7 +1,14 @@
 #include "sdl.h"
 
 #include <Arduino_GFX_Library.h>
+#include <atomic>
 #include "SPI.h"
+#include "soc/gpio_reg.h"
+#include "framequeue.h"
+#include "latency.h"
+#include "lcd.h"
+#include "pixel.h"
+#include "stream.h"
 
 // Pin definitions for the display
 #define _cs 15    // Chip Select for TFT
@@ -36,17 +43,87 @@ Arduino_GFX *tft = new Arduino_ILI9341(bus, _rst, 3 /* rotation */);
 
 #define SPI_FREQ 40000000
 
-// Frame buffer for storing graphical data
-static uint8_t *frame_buffer;
+#ifdef FRAMEBUFFER_2BPP
+#define FRAMEBUFFER_SIZE (GAMEBOY_WIDTH * GAMEBOY_HEIGHT / 4)
+#else
+#define FRAMEBUFFER_SIZE (DRAW_WIDTH * DRAW_HEIGHT)
+#endif
+
+#define H_OFFSET ((SCREEN_WIDTH - DRAW_WIDTH) / 2)
+#define V_OFFSET ((SCREEN_HEIGHT - DRAW_HEIGHT) / 2)
+
+// RGB565 colours of the four Game Boy shades
+static uint16_t color_palette[] = { 0xffff, (16 << 11) + (32 << 5) + 16, (8 << 11) + (16 << 5) + 8, 0x0000 };
+
+// Frame buffers handed between the emulator and the draw task
+static pixel_t *frame_buffers[FRAME_BUFFERS];
+
+#ifdef FRAMEBUFFER_2BPP
+// Byte-swapped shade colours
+static uint16_t be_palette[4];
+#endif
+#if defined(FRAMEBUFFER_2BPP) || defined(FRAMEBUFFER_RGB565)
+// Scaled RGB565 rows gathered for one address window
+alignas(4) static uint16_t band[3 * DRAW_WIDTH];
+#endif
+
+// Bytes of the column address, page address and memory write commands that
+// open an address window, and everything sent to the display so far
+#define WINDOW_BYTES 11
+#define FRAME_BYTES (DRAW_WIDTH * DRAW_HEIGHT * 2 + WINDOW_BYTES)
+static std::atomic<uint32_t> spi_bytes;
+static std::atomic<uint32_t> spi_us;  // Time spent sending, in microseconds
+
+#if defined(LATENCY_PROBE) && !defined(SDL_STREAM_LINES)
+// Latency probe id of the frame held by each buffer
+static uint32_t slot_frame[FRAME_BUFFERS];
+#endif
+
+// Button states, directions in the low nibble (right, left, up, down from
+// bit 0) and buttons in the high nibble (A, B, select, start). Written by the
+// GPIO edge interrupt, read by the emulator whenever it samples the joypad.
+static std::atomic<unsigned int> joypad_state;
+// Buttons pressed since sdl_take_joypad_presses() was last called
+static std::atomic<unsigned int> joypad_presses;
+static void joypad_isr(void *arg);
 
-// Variables for button states
-static int button_start, button_select, button_a, button_b, button_down,
-    button_up, button_left, button_right;
-
-// Flag to indicate when a new frame is ready
-static volatile bool frame_ready = false;
 TaskHandle_t draw_task_handle; // Task handle for the draw task
 
+#ifdef SDL_DIRTY_RECTS
+#define TILES_X (GAMEBOY_WIDTH / 8)
+#define TILES_Y (GAMEBOY_HEIGHT / 8)
+#define MAX_RECTS 32
+
+// Changed area of the frame in native tiles, [x0, x1) by [y0, y1)
+struct rect {
+  uint8_t x0, x1, y0, y1;
+};
+
+// Tile hashes of the last frame planned and the rectangles of the next
+// update (num_rects is -1 when the whole frame is sent)
+static uint32_t shown_hash[TILES_Y][TILES_X];
+static bool shown_valid = false;
+static struct rect rects[MAX_RECTS];
+static int num_rects;
+#elif defined(LCD_LINE_MEMO) && !defined(SDL_STREAM_LINES)
+// Line signatures of the frame in each buffer and of the last frame planned,
+// and the lines of the next update
+static uint32_t frame_sigs[FRAME_BUFFERS][GAMEBOY_HEIGHT];
+static uint32_t shown_sigs[GAMEBOY_HEIGHT];
+static bool shown_valid = false;
+static bool line_changed[GAMEBOY_HEIGHT];
+#endif
+
+#ifdef SDL_INTERLACE
+// Bytes of one field: every other output row, each in its own window
+#define FIELD_BYTES (DRAW_HEIGHT / 2 * (DRAW_WIDTH * 2 + WINDOW_BYTES))
+
+static bool interlaced;    // Sending one field per frame
+static int next_field;     // Parity of the output rows sent next
+static uint32_t bus_bytes_per_ms = SPI_FREQ / 8 / 1000;  // Measured throughput
+static std::atomic<uint32_t> interlaced_frames;
+#endif
+
 //Uncomment if Backlight is used
 /*void backlighting(bool state) {
   if (!state) {
@@ -65,37 +142,49 @@ void sd_card_missing(void) {
   tft->printf("SD card missing");
 }
 
+/**
+ * @brief Displays a message indicating there are no ROMs on the SD card.
+ */
+void no_roms_found(void) {
+  tft->setTextSize(3);
+  tft->printf("No ROMs found");
+}
+
 // Number of files to display at once
 #define DISPLAY_ROWS 6
 
 /**
- * @brief Displays a list of files on the screen and allows selection using buttons.
+ * @brief Displays the ROMs of the catalogue and allows selection using buttons.
+ *
+ * Only the visible rows are read from the catalogue, so the list can be long.
  *
- * @param file_list List of file names to display.
- * @param file_count Total number of files.
- * @return The index of the selected file.
+ * @param file_count Total number of ROMs in the catalogue.
+ * @return The index of the selected ROM.
  */
-int display_files_on_lcd(char file_list[MAX_FILES][MAX_FILENAME_LEN], int file_count) {
+int display_files_on_lcd(int file_count) {
     int selected_file_index = 0;       // Currently selected file
     int previous_selected_index = -1; // Tracks the last selection
     int window_start_index = 0;       // Start index for visible files
+    int last_window_start = file_count > DISPLAY_ROWS ? file_count - DISPLAY_ROWS : 0;
+    struct catalog_entry entry;
 
     while (1) { // Infinite loop to handle file selection
         button_update(); // Update button states
+        unsigned int directions = sdl_get_directions();
 
         // Logic for navigation
-        if (button_up) {
+        if (directions & 0x4) { // Up
             // Move to the previous file, loop to the last file if at the top
             if (selected_file_index == 0) {
                 selected_file_index = file_count - 1;
-                window_start_index = file_count - DISPLAY_ROWS;
+                window_start_index = last_window_start;
             } else {
                 selected_file_index--;
                 if (selected_file_index < window_start_index) {
                     window_start_index--;
                 }
             }
-        } else if (button_down) {
+        } else if (directions & 0x8) { // Down
             // Move to the next file, loop to the first file if at the bottom
             if (selected_file_index == file_count - 1) {
                 selected_file_index = 0;
@@ -106,9 +195,11 @@ int display_files_on_lcd(char file_list[MAX_FILES][MAX_FILENAME_LEN], int file_c
                     window_start_index++;
                 }
             }
-        } else if (button_a) { // Select the file
+        } else if (sdl_get_buttons() & 0x1) { // A selects the file
             clearScreen();
-            printf("Selected file: %s\n", file_list[selected_file_index]);
+            if (catalog_get(selected_file_index, &entry)) {
+                printf("Selected file: %s\n", entry.path);
+            }
             return selected_file_index;
         }
 
@@ -121,11 +212,12 @@ int display_files_on_lcd(char file_list[MAX_FILES][MAX_FILENAME_LEN], int file_c
                 tft->setTextSize(2);
 
                 int file_index = window_start_index + i;
+                if (!catalog_get(file_index, &entry)) break;
 
                 if (file_index == selected_file_index) {
-                    tft->printf("> File: %s\n", file_list[file_index]); // Highlight selected file
+                    tft->printf("> File: %s\n", catalog_name(&entry)); // Highlight selected file
                 } else {
-                    tft->printf("File: %s\n", file_list[file_index]);
+                    tft->printf("File: %s\n", catalog_name(&entry));
                 }
             }
 
@@ -143,73 +235,488 @@ void clearScreen(void) {
   tft->setCursor(0, 0);    // Move the cursor to the top-left corner
 }
 
+/**
+ * @brief Counts the bytes one address window and its pixels take on the bus.
+ *
+ * @param w Width of the window in pixels.
+ * @param h Height of the window in pixels.
+ */
+static void count_window(int w, int h) {
+  spi_bytes += w * h * 2 + WINDOW_BYTES;
+}
+
+#ifdef FRAMEBUFFER_2BPP
+/**
+ * @brief Expands part of one packed native line into scaled RGB565 rows.
+ *
+ * @param fb Frame buffer to read from.
+ * @param line Native line to expand.
+ * @param x0 First native pixel, a multiple of 4.
+ * @param n Number of native pixels.
+ * @param dst First destination row; odd lines fill two rows of n * 3 / 2.
+ * @return Number of rows written.
+ */
+static int expand_line(const pixel_t *fb, int line, int x0, int n, uint16_t *dst) {
+  alignas(4) uint8_t shades[GAMEBOY_WIDTH];
+  alignas(4) uint16_t colors[GAMEBOY_WIDTH];
+  int w = n * 3 / 2;
+
+  pixel_expand_2bpp(&fb[line * (GAMEBOY_WIDTH / 4) + x0 / 4], shades, n);
+  pixel_apply_lut(shades, colors, be_palette, n);
+  pixel_scale_3_2_16(colors, dst, n);
+
+  int rows = (line + 1) * 3 / 2 - line * 3 / 2;
+  if (rows == 2) memcpy(dst + w, dst, w * sizeof(uint16_t));
+  return rows;
+}
+#endif
+
+/**
+ * @brief Sends a rectangle of the frame to the display in one address window
+ * (or one per pair of lines when it has to be converted first).
+ *
+ * @param fb Frame buffer to send from.
+ * @param x0 First native column, a multiple of 4.
+ * @param x1 Column after the last one, a multiple of 2.
+ * @param l0 First native line to send.
+ * @param l1 Line after the last one to send.
+ */
+static void push_rect(pixel_t *fb, int x0, int x1, int l0, int l1) {
+  int sx = x0 * 3 / 2;
+  int w = x1 * 3 / 2 - sx;
+#ifdef FRAMEBUFFER_2BPP
+  // Scale and convert one pair of lines (three rows) at a time
+  while (l0 < l1) {
+    int y = l0 * 3 / 2;
+    int rows = 0;
+    do {
+      rows += expand_line(fb, l0, x0, x1 - x0, &band[rows * w]);
+      l0++;
+    } while (l0 < l1 && (l0 & 1));
+    tft->draw16bitBeRGBBitmap(H_OFFSET + sx, V_OFFSET + y, band, w, rows);
+    count_window(w, rows);
+  }
+#else
+  int y0 = l0 * 3 / 2;
+  int y1 = l1 * 3 / 2;
+#ifdef FRAMEBUFFER_RGB565
+  // Already in display byte order, no conversion needed
+  if (w == DRAW_WIDTH) {
+    tft->draw16bitBeRGBBitmap(H_OFFSET, V_OFFSET + y0, &fb[y0 * DRAW_WIDTH], DRAW_WIDTH, y1 - y0);
+    count_window(w, y1 - y0);
+    return;
+  }
+  // Narrower rectangles are gathered into the band buffer a few rows at a time
+  int chunk = sizeof(band) / sizeof(band[0]) / w;
+  for (int y = y0; y < y1; y += chunk) {
+    int rows = std::min(chunk, y1 - y);
+    for (int r = 0; r < rows; r++) {
+      memcpy(&band[r * w], &fb[(y + r) * DRAW_WIDTH + sx], w * sizeof(pixel_t));
+    }
+    tft->draw16bitBeRGBBitmap(H_OFFSET + sx, V_OFFSET + y, band, w, rows);
+    count_window(w, rows);
+  }
+#else
+  tft->drawIndexedBitmap(H_OFFSET + sx, V_OFFSET + y0, &fb[y0 * DRAW_WIDTH + sx], color_palette, w, y1 - y0, DRAW_WIDTH - w);
+  count_window(w, y1 - y0);
+#endif
+#endif
+}
+
+/**
+ * @brief Sends a range of native lines to the display.
+ *
+ * @param fb Frame buffer to send from.
+ * @param l0 First line to send.
+ * @param l1 Line after the last one to send.
+ */
+static void push_lines(pixel_t *fb, int l0, int l1) {
+  push_rect(fb, 0, GAMEBOY_WIDTH, l0, l1);
+}
+
+#ifdef SDL_DIRTY_RECTS
+/**
+ * @brief Hashes the pixels of one 8x8 native tile of the frame.
+ *
+ * @param fb Frame buffer to read from.
+ * @param tx Tile column.
+ * @param ty Tile row.
+ * @return FNV-1a hash of the tile's distinct rows.
+ */
+static uint32_t tile_hash(const pixel_t *fb, int tx, int ty) {
+  uint32_t h = 2166136261u;
+#ifdef FRAMEBUFFER_2BPP
+  const pixel_t *p = &fb[ty * 8 * (GAMEBOY_WIDTH / 4) + tx * 2];
+  for (int n = 0; n < 8; n++, p += GAMEBOY_WIDTH / 4) {
+    h = (h ^ (p[0] << 8 | p[1])) * 16777619u;
+  }
+#else
+  // The second row of a doubled line is a copy, only hash the first one
+  for (int n = 0; n < 8; n++) {
+    const uint8_t *p = (const uint8_t *)&fb[(ty * 12 + n * 3 / 2) * DRAW_WIDTH + tx * 12];
+    for (unsigned i = 0; i < 12 * sizeof(pixel_t); i += 4) {
+      uint32_t word;
+      memcpy(&word, p + i, 4);
+      h = (h ^ word) * 16777619u;
+    }
+  }
+#endif
+  return h;
+}
+
+/**
+ * @brief Adds a run of dirty tiles, extending the rectangle right above it
+ * when that one covers exactly the same columns.
+ *
+ * @param x0 First dirty tile column.
+ * @param x1 Column after the last dirty tile.
+ * @param ty Tile row of the run.
+ * @return False if there is no room for another rectangle.
+ */
+static bool add_dirty_run(int x0, int x1, int ty) {
+  for (int i = 0; i < num_rects; i++) {
+    if (rects[i].y1 == ty && rects[i].x0 == x0 && rects[i].x1 == x1) {
+      rects[i].y1++;
+      return true;
+    }
+  }
+  if (num_rects == MAX_RECTS) return false;
+  rects[num_rects++] = { (uint8_t)x0, (uint8_t)x1, (uint8_t)ty, (uint8_t)(ty + 1) };
+  return true;
+}
+
+/**
+ * @brief Finds the rectangles that differ from the last frame planned.
+ *
+ * @param fb Frame buffer of the new frame.
+ * @return Bytes the update needs; the whole frame's when it is not worth
+ * splitting, in which case num_rects is set to -1.
+ */
+static uint32_t plan_dirty(const pixel_t *fb) {
+  bool full = !shown_valid;
+  num_rects = 0;
+
+  for (int ty = 0; ty < TILES_Y; ty++) {
+    uint32_t mask = 0;
+    for (int tx = 0; tx < TILES_X; tx++) {
+      uint32_t h = tile_hash(fb, tx, ty);
+      if (h != shown_hash[ty][tx]) {
+        shown_hash[ty][tx] = h;
+        mask |= 1u << tx;
+      }
+    }
+    for (int tx = 0; tx < TILES_X && !full;) {
+      if (!(mask >> tx & 1)) {
+        tx++;
+        continue;
+      }
+      int x0 = tx;
+      while (tx < TILES_X && (mask >> tx & 1)) tx++;
+      full = !add_dirty_run(x0, tx, ty);
+    }
+  }
+  shown_valid = true;
+
+  uint32_t bytes = 0;
+  for (int i = 0; i < num_rects; i++) {
+    bytes += (rects[i].x1 - rects[i].x0) * (rects[i].y1 - rects[i].y0) * 12 * 12 * 2 + WINDOW_BYTES;
+  }
+  if (full || bytes * 100 > FRAME_BYTES * SDL_DIRTY_FULL_PERCENT) {
+    num_rects = -1;
+    return FRAME_BYTES;
+  }
+  return bytes;
+}
+
+/**
+ * @brief Sends the rectangles found by plan_dirty(), or the whole frame.
+ *
+ * @param fb Frame buffer to send from.
+ */
+static void push_dirty(pixel_t *fb) {
+  if (num_rects < 0) {
+    push_lines(fb, 0, GAMEBOY_HEIGHT);
+    return;
+  }
+  for (int i = 0; i < num_rects; i++) {
+    push_rect(fb, rects[i].x0 * 8, rects[i].x1 * 8, rects[i].y0 * 8, rects[i].y1 * 8);
+  }
+}
+#endif
+
+#ifdef SDL_STREAM_LINES
+/**
+ * @brief Sends one band of lines as soon as the renderer finished it.
+ *
+ * @param l0 First line of the band.
+ * @param l1 Line after the last one of the band.
+ */
+static void push_band(int l0, int l1) {
+  uint32_t start = micros();
+  push_lines(frame_buffers[0], l0, l1);
+  spi_us += micros() - start;
+}
+#else
+#if defined(LCD_LINE_MEMO) && !defined(SDL_DIRTY_RECTS)
+/**
+ * @brief Marks the lines whose signature differs from the last frame planned.
+ *
+ * @param sigs Line signatures of the new frame.
+ * @return Bytes needed to send the changed lines.
+ */
+static uint32_t plan_lines(const uint32_t *sigs) {
+  uint32_t bytes = 0;
+  for (int line = 0; line < GAMEBOY_HEIGHT; line++) {
+    line_changed[line] = !(shown_valid && sigs[line] == shown_sigs[line]);
+    if (!line_changed[line]) continue;
+    shown_sigs[line] = sigs[line];
+    bytes += ((line + 1) * 3 / 2 - line * 3 / 2) * DRAW_WIDTH * 2;
+    if (line == 0 || !line_changed[line - 1]) bytes += WINDOW_BYTES;
+  }
+  shown_valid = true;
+  return bytes;
+}
+
+/**
+ * @brief Sends the runs of lines marked by plan_lines().
+ *
+ * @param fb Frame buffer to send from.
+ */
+static void push_changed_lines(pixel_t *fb) {
+  int line = 0;
+  while (line < GAMEBOY_HEIGHT) {
+    if (!line_changed[line]) {
+      line++;
+      continue;
+    }
+    int end = line;
+    while (end < GAMEBOY_HEIGHT && line_changed[end]) end++;
+    push_lines(fb, line, end);
+    line = end;
+  }
+}
+#endif
+
+/**
+ * @brief Works out what has to be sent to bring the display from the last
+ * frame planned to this one.
+ *
+ * @param fb Frame buffer of the new frame.
+ * @param slot Index of that frame buffer.
+ * @return Bytes the update needs.
+ */
+static uint32_t plan_update(const pixel_t *fb, int slot) {
+#if defined(SDL_DIRTY_RECTS)
+  return plan_dirty(fb);
+#elif defined(LCD_LINE_MEMO)
+  return plan_lines(frame_sigs[slot]);
+#else
+  return FRAME_BYTES;
+#endif
+}
+
+/**
+ * @brief Sends the update worked out by plan_update().
+ *
+ * @param fb Frame buffer to send from.
+ */
+static void push_update(pixel_t *fb) {
+#if defined(SDL_DIRTY_RECTS)
+  push_dirty(fb);
+#elif defined(LCD_LINE_MEMO)
+  push_changed_lines(fb);
+#else
+  push_lines(fb, 0, GAMEBOY_HEIGHT);
+#endif
+}
+
+#ifdef SDL_INTERLACE
+/**
+ * @brief Sends one output row in its own address window.
+ *
+ * @param fb Frame buffer to send from.
+ * @param y Output row, 0 to DRAW_HEIGHT - 1.
+ */
+static void push_row(pixel_t *fb, int y) {
+#ifdef FRAMEBUFFER_2BPP
+  expand_line(fb, (2 * y + 1) / 3, 0, GAMEBOY_WIDTH, band);
+  tft->draw16bitBeRGBBitmap(H_OFFSET, V_OFFSET + y, band, DRAW_WIDTH, 1);
+#elif defined(FRAMEBUFFER_RGB565)
+  tft->draw16bitBeRGBBitmap(H_OFFSET, V_OFFSET + y, &fb[y * DRAW_WIDTH], DRAW_WIDTH, 1);
+#else
+  tft->drawIndexedBitmap(H_OFFSET, V_OFFSET + y, &fb[y * DRAW_WIDTH], color_palette, DRAW_WIDTH, 1);
+#endif
+  count_window(DRAW_WIDTH, 1);
+}
+
+/**
+ * @brief Sends every other output row of the frame.
+ *
+ * @param fb Frame buffer to send from.
+ * @param parity 0 for the even rows, 1 for the odd ones.
+ */
+static void push_field(pixel_t *fb, int parity) {
+  for (int y = parity; y < DRAW_HEIGHT; y += 2) push_row(fb, y);
+}
+
+/**
+ * @brief Sends the frame progressively when the bus can do it within the
+ * frame budget, otherwise only the next field.
+ *
+ * @param fb Frame buffer to send from.
+ * @param need Bytes of the progressive update from plan_update().
+ */
+static void present_interlaced(pixel_t *fb, uint32_t need) {
+  uint32_t need_us = need * 1000 / bus_bytes_per_ms;
+  uint32_t field_us = FIELD_BYTES * 1000 / bus_bytes_per_ms;
+
+  if (!interlaced) {
+    if (need_us <= SDL_INTERLACE_BUDGET_US) {
+      push_update(fb);
+      return;
+    }
+    interlaced = true;
+  } else if (need_us + field_us <= SDL_INTERLACE_BUDGET_US) {
+    // The next field still shows the frame before last; the other one only
+    // misses the changes since the last frame
+    push_field(fb, next_field);
+    push_update(fb);
+    interlaced = false;
+    return;
+  }
+
+  push_field(fb, next_field);
+  next_field ^= 1;
+  interlaced_frames++;
+}
+#endif
+
 /**
  * @brief Task to draw the frame buffer to the display.
  *
  * @param parameter Not used in this implementation.
  */
 void draw_task(void *parameter) {
-  // Color palette for indexed graphics
-  uint16_t color_palette[] = { 0xffff, (16 << 11) + (32 << 5) + 16, (8 << 11) + (16 << 5) + 8, 0x0000 };
-
-  int h_offset = (SCREEN_WIDTH - DRAW_WIDTH) / 2;
-  int v_offset = (SCREEN_HEIGHT - DRAW_HEIGHT) / 2;
-
   while (true) {
-    while (!frame_ready) {
-      delay(1); // Wait for the frame to be ready
+    // Sleeps until the emulator publishes a frame, then takes the newest one
+    int slot = frame_queue_acquire();
+    pixel_t *fb = frame_buffers[slot];
+    uint32_t start = micros();
+    uint32_t start_bytes = spi_bytes;
+
+#ifdef SDL_INTERLACE
+    present_interlaced(fb, plan_update(fb, slot));
+#else
+    plan_update(fb, slot);
+    push_update(fb);
+#endif
+
+    uint32_t elapsed = micros() - start;
+    spi_us += elapsed;
+#ifdef LATENCY_PROBE
+    latency_presented(slot_frame[slot]);
+#endif
+#ifdef SDL_INTERLACE
+    // Short updates are mostly per-window overhead, they would skew the rate
+    uint32_t bytes = spi_bytes - start_bytes;
+    if (bytes >= FIELD_BYTES / 2 && elapsed > 0) {
+      uint32_t rate = (uint64_t)bytes * 1000 / elapsed;
+      bus_bytes_per_ms += ((int32_t)rate - (int32_t)bus_bytes_per_ms) / 8;
     }
-    frame_ready = false;
+#endif
 
-    // Draw the indexed bitmap
-    tft->drawIndexedBitmap(h_offset, v_offset, frame_buffer, color_palette, DRAW_WIDTH, DRAW_HEIGHT);
+    frame_queue_release();
   }
 }
+#endif
 
 /**
  * @brief Initializes the SDL-like environment.
  */
 void sdl_init(void) {
-  frame_buffer = new uint8_t[DRAW_WIDTH * DRAW_HEIGHT]; // Allocate memory for the frame buffer
+  for (int i = 0; i < FRAME_BUFFERS; i++) {
+    frame_buffers[i] = new pixel_t[FRAMEBUFFER_SIZE](); // Allocate memory for the frame buffers
+  }
+#ifdef SDL_STREAM_LINES
+  stream_init(push_band);
+#else
+  frame_queue_init(FRAME_BUFFERS);
+#endif
+#ifdef FRAMEBUFFER_2BPP
+  for (int i = 0; i < 4; i++) be_palette[i] = (color_palette[i] >> 8) | (color_palette[i] << 8);
+#endif
   tft->begin(SPI_FREQ); // Initialize the TFT with specified SPI frequency
   //pinMode(_led, OUTPUT); //Uncomment if backlight is used
   //backlighting(true); //Uncomment if backlight is used
   tft->fillScreen(BLACK);
 
-  // Set up the GPIO pins for the buttons
+  // Set up the GPIO pins for the buttons, every edge updates the state
   gpio_num_t gpios[] = { _left, _right, _down, _up, _start, _select, _a, _b };
+  gpio_install_isr_service(0);
   for (gpio_num_t pin : gpios) {
     esp_rom_gpio_pad_select_gpio(pin);
     gpio_set_direction(pin, GPIO_MODE_INPUT);
+    gpio_set_intr_type(pin, GPIO_INTR_ANYEDGE);
+    gpio_isr_handler_add(pin, joypad_isr, NULL);
   }
+  button_update();
 
   // Start the draw task
+#ifdef SDL_STREAM_LINES
+  xTaskCreatePinnedToCore(stream_task, "drawTask", 10000, NULL, 0, &draw_task_handle, 0);
+#else
   xTaskCreatePinnedToCore(draw_task, "drawTask", 10000, NULL, 0, &draw_task_handle, 0);
+#endif
 }
 
 /**
  * @brief Updates the SDL state and processes frames.
  */
 int sdl_update(void) {
-  button_update(); // Update button states
-  sdl_frame();     // Process a frame
+  sdl_frame(); // Process a frame, buttons are kept current by joypad_isr
   return 0;
 }
 
 /**
  * @brief Updates the state of all buttons.
+ *
+ * The edge interrupt keeps the state current, so this is only needed before
+ * the interrupt is installed or where input is polled, as in the file menu.
  */
-void button_update(void) {
-  button_up = gpio_get_level(_up);
-  button_left = gpio_get_level(_left);
-  button_down = gpio_get_level(_down);
-  button_right = gpio_get_level(_right);
+void IRAM_ATTR button_update(void) {
+  // All button pins are in 32..48, one read of GPIO_IN1_REG has them all
+  uint32_t in = REG_READ(GPIO_IN1_REG);
+  unsigned int state = ((in >> (_right - 32)) & 1) | ((in >> (_left - 32)) & 1) << 1 |
+                       ((in >> (_up - 32)) & 1) << 2 | ((in >> (_down - 32)) & 1) << 3 |
+                       ((in >> (_a - 32)) & 1) << 4 | ((in >> (_b - 32)) & 1) << 5 |
+                       ((in >> (_select - 32)) & 1) << 6 | ((in >> (_start - 32)) & 1) << 7;
+  sdl_set_joypad(state);
+}
 
-  button_start = gpio_get_level(_start);
-  button_select = gpio_get_level(_select);
+/**
+ * @brief Sets the state of all buttons, for button_update() and scripted input.
+ *
+ * @param state Directions in the low nibble and buttons in the high nibble.
+ */
+void IRAM_ATTR sdl_set_joypad(unsigned int state) {
+  unsigned int prev = joypad_state.exchange(state, std::memory_order_relaxed);
+  unsigned int pressed = state & ~prev;
+
+  if (pressed) {
+    joypad_presses.fetch_or(pressed, std::memory_order_relaxed);
+#ifdef LATENCY_PROBE
+    latency_edge(pressed);
+#endif
+  }
+}
 
-  button_a = gpio_get_level(_a);
-  button_b = gpio_get_level(_b);
+/**
+ * @brief GPIO interrupt handler for any edge on a button pin.
+ *
+ * @param arg Unused.
+ */
+static void IRAM_ATTR joypad_isr(void *arg) {
+  button_update();
 }
 
 /**
@@ -218,7 +725,7 @@ void button_update(void) {
  * @return A bitfield representing the state of the buttons.
  */
 unsigned int sdl_get_buttons(void) {
-  return (button_start * 8) | (button_select * 4) | (button_b * 2) | button_a;
+  return joypad_state.load(std::memory_order_relaxed) >> 4;
 }
 
 /**
@@ -227,7 +734,19 @@ unsigned int sdl_get_buttons(void) {
  * @return A bitfield representing the state of the directional buttons.
  */
 unsigned int sdl_get_directions(void) {
-  return (button_down * 8) | (button_up * 4) | (button_left * 2) | button_right;
+  return joypad_state.load(std::memory_order_relaxed) & 0xF;
+}
+
+/**
+ * @brief Takes the buttons pressed since the last call.
+ *
+ * @return Directions in the low nibble and buttons in the high nibble, laid
+ *         out as in sdl_get_directions() and sdl_get_buttons().
+ */
+unsigned int sdl_take_joypad_presses(void) {
+  // Cheap test first, this is called once per line
+  if (!joypad_presses.load(std::memory_order_relaxed)) return 0;
+  return joypad_presses.exchange(0, std::memory_order_relaxed);
 }
 
 /**
@@ -235,13 +754,73 @@ unsigned int sdl_get_directions(void) {
  *
  * @return Pointer to the frame buffer.
  */
-uint8_t *sdl_get_framebuffer(void) {
-  return frame_buffer;
+pixel_t *sdl_get_framebuffer(void) {
+  return frame_buffers[frame_queue_back()];
+}
+
+/**
+ * @brief Gets the index of the frame buffer the emulator draws into.
+ *
+ * @return Index between 0 and FRAME_BUFFERS - 1.
+ */
+int sdl_get_framebuffer_index(void) {
+  return frame_queue_back();
+}
+
+/**
+ * @brief Gets the RGB565 colours of the four shades.
+ *
+ * @return Pointer to the 4-entry colour palette.
+ */
+const uint16_t *sdl_get_palette(void) {
+  return color_palette;
+}
+
+/**
+ * @brief Gets the number of bytes sent to the display so far.
+ *
+ * @return Pixel and address window bytes, wrapping at 2^32.
+ */
+uint32_t sdl_get_spi_bytes(void) {
+  return spi_bytes;
+}
+
+/**
+ * @brief Gets the time spent sending to the display so far.
+ *
+ * @return Microseconds, wrapping at 2^32.
+ */
+uint32_t sdl_get_spi_us(void) {
+  return spi_us;
+}
+
+/**
+ * @brief Gets the number of frames sent as a single field so far.
+ *
+ * @return Interlaced frames, 0 unless SDL_INTERLACE is defined.
+ */
+uint32_t sdl_get_interlaced_frames(void) {
+#ifdef SDL_INTERLACE
+  return interlaced_frames;
+#else
+  return 0;
+#endif
 }
 
 /**
- * @brief Marks the frame as ready for drawing.
+ * @brief Hands the finished frame to the draw task without waiting.
  */
 void sdl_frame(void) {
-  frame_ready = true;
+#ifdef SDL_STREAM_LINES
+  // Every band was already queued as it was rendered
+#else
+#if defined(LCD_LINE_MEMO) && !defined(SDL_DIRTY_RECTS)
+  memcpy(frame_sigs[frame_queue_back()], lcd_get_line_signatures(), sizeof(frame_sigs[0]));
+#endif
+#ifdef LATENCY_PROBE
+  // The frame lcd_cycle just finished
+  slot_frame[frame_queue_back()] = latency_frame_id() - 1;
+#endif
+  frame_queue_publish();
+#endif
 }
@@ -1,20 +1,88 @@
-#include <Arduino.h>
 #ifndef SDL_H
 #define SDL_H
+#include <stdint.h>
+#ifndef BUILD_FOR_PC
+#include <Arduino.h>
+#endif
+
+#include "catalog.h"
+
+// Store the framebuffer as big-endian RGB565 instead of palette indices so
+// the draw task can send it to the display without a conversion pass.
+// This doubles the framebuffer to 103,680 bytes.
+//#define FRAMEBUFFER_RGB565
+
+// Store the native 160x144 frame packed at 2 bits per pixel (5,760 bytes,
+// first pixel in the top bits). Scaling and colour conversion happen while
+// lines are streamed to the display.
+//#define FRAMEBUFFER_2BPP
+
+#if defined(FRAMEBUFFER_RGB565) && defined(FRAMEBUFFER_2BPP)
+#error "Select at most one framebuffer format"
+#endif
+
+// Send each band of finished lines to the display while the rest of the
+// frame is still being emulated instead of pushing whole frames (see
+// stream.h). Uses a single frame buffer.
+//#define SDL_STREAM_LINES
 
-//Only for the MAX_FILENAME_LEN and MAX_FILES
-#include "sd.h"
+// Only send the parts of each frame that changed since the last one shown.
+// The draw task hashes every 8x8 native tile, merges changed tiles into a few
+// rectangles and sends each through its own address window. If the
+// rectangles add up to more than SDL_DIRTY_FULL_PERCENT of the frame's bytes
+// the whole frame is sent instead.
+//#define SDL_DIRTY_RECTS
+#ifndef SDL_DIRTY_FULL_PERCENT
+#define SDL_DIRTY_FULL_PERCENT 80
+#endif
+
+// When an update would take the bus longer than SDL_INTERLACE_BUDGET_US at
+// the measured throughput, send only the even or the odd output rows of
+// each frame, alternating. Progressive updates resume once the changes plus
+// the missing field fit in the budget again.
+//#define SDL_INTERLACE
+#ifndef SDL_INTERLACE_BUDGET_US
+#define SDL_INTERLACE_BUDGET_US 16000
+#endif
+
+#if defined(SDL_STREAM_LINES) && (defined(SDL_DIRTY_RECTS) || defined(SDL_INTERLACE))
+#error "SDL_DIRTY_RECTS and SDL_INTERLACE need whole frames, they cannot be used with SDL_STREAM_LINES"
+#endif
+
+// Frame buffers rotated between the emulator and the draw task, 2 or 3.
+// Three let the emulator run ahead without ever overwriting the frame on
+// screen; two save one buffer of RAM but drop frames while drawing.
+#ifdef SDL_STREAM_LINES
+#undef FRAME_BUFFERS
+#define FRAME_BUFFERS 1
+#elif !defined(FRAME_BUFFERS)
+#define FRAME_BUFFERS 3
+#endif
+
+#ifdef FRAMEBUFFER_RGB565
+typedef uint16_t pixel_t;
+#else
+typedef uint8_t pixel_t;
+#endif
 
 int sdl_update(void);
 void button_update(void);
 void sdl_init(void);
 void sdl_frame(void);
 void sdl_quit(void);
-uint8_t *sdl_get_framebuffer(void);
+pixel_t *sdl_get_framebuffer(void);
+int sdl_get_framebuffer_index(void);
+const uint16_t *sdl_get_palette(void);
+uint32_t sdl_get_spi_bytes(void);
+uint32_t sdl_get_spi_us(void);
+uint32_t sdl_get_interlaced_frames(void);
 unsigned int sdl_get_buttons(void);
 unsigned int sdl_get_directions(void);
+unsigned int sdl_take_joypad_presses(void);
+void sdl_set_joypad(unsigned int state);
 
-int display_files_on_lcd(char file_list[MAX_FILES][MAX_FILENAME_LEN], int file_count);
+int display_files_on_lcd(int file_count);
 void sd_card_missing(void);
+void no_roms_found(void);
 void clearScreen(void);
 #endif
@@ -0,0 +1,177 @@
+#ifdef BUILD_FOR_PC
+/*
+ * Host stand-in for sdl.cpp, used by the BUILD_FOR_PC build in main.cpp.
+ * There is no window: a draw thread takes frames (or bands with
+ * SDL_STREAM_LINES) as the device's draw task does and holds each for the
+ * time its bytes take on the 40 MHz SPI bus, so the frame queue, streaming
+ * and the latency probe behave as on the device.
+ */
+#include "sdl.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "framequeue.h"
+#include "latency.h"
+#include "stream.h"
+
+#define GAMEBOY_HEIGHT 144
+#define GAMEBOY_WIDTH 160
+#define DRAW_HEIGHT 216
+#define DRAW_WIDTH 240
+
+// Matches SPI_FREQ in sdl.cpp
+#define SPI_FREQ 40000000
+
+#ifdef FRAMEBUFFER_2BPP
+#define FRAMEBUFFER_SIZE (GAMEBOY_WIDTH * GAMEBOY_HEIGHT / 4)
+#else
+#define FRAMEBUFFER_SIZE (DRAW_WIDTH * DRAW_HEIGHT)
+#endif
+
+// A full frame and the commands that open its address window
+#define WINDOW_BYTES 11
+#define FRAME_BYTES (DRAW_WIDTH * DRAW_HEIGHT * 2 + WINDOW_BYTES)
+
+static uint16_t color_palette[] = { 0xffff, (16 << 11) + (32 << 5) + 16, (8 << 11) + (16 << 5) + 8, 0x0000 };
+
+static pixel_t *frame_buffers[FRAME_BUFFERS];
+
+static std::atomic<uint32_t> spi_bytes;
+static std::atomic<uint32_t> spi_us;
+
+#if defined(LATENCY_PROBE) && !defined(SDL_STREAM_LINES)
+static uint32_t slot_frame[FRAME_BUFFERS];
+#endif
+
+// Laid out as in sdl.cpp
+static std::atomic<unsigned int> joypad_state;
+static std::atomic<unsigned int> joypad_presses;
+
+#ifndef SDL_STREAM_LINES
+static uint32_t now_us(void) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * @brief Draw thread, presents every frame as a full-frame transfer.
+ */
+static void draw_task(void) {
+  while (true) {
+    [[maybe_unused]] int slot = frame_queue_acquire();
+    uint32_t start = now_us();
+
+    std::this_thread::sleep_for(std::chrono::microseconds((uint64_t)FRAME_BYTES * 8 * 1000000 / SPI_FREQ));
+    spi_bytes += FRAME_BYTES;
+    spi_us += now_us() - start;
+#ifdef LATENCY_PROBE
+    latency_presented(slot_frame[slot]);
+#endif
+    frame_queue_release();
+  }
+}
+#endif
+
+/**
+ * @brief Allocates the frame buffers and starts the draw thread.
+ */
+void sdl_init(void) {
+  for (int i = 0; i < FRAME_BUFFERS; i++) {
+    frame_buffers[i] = new pixel_t[FRAMEBUFFER_SIZE]();
+  }
+#ifdef SDL_STREAM_LINES
+  stream_init(stream_mock_sink);
+  std::thread(stream_task, (void *)NULL).detach();
+#else
+  frame_queue_init(FRAME_BUFFERS);
+  std::thread(draw_task).detach();
+#endif
+}
+
+/**
+ * @brief Hands the finished frame to the draw thread.
+ */
+int sdl_update(void) {
+  sdl_frame();
+  return 0;
+}
+
+/**
+ * @brief Hands the finished frame to the draw thread without waiting.
+ */
+void sdl_frame(void) {
+#ifndef SDL_STREAM_LINES
+#ifdef LATENCY_PROBE
+  slot_frame[frame_queue_back()] = latency_frame_id() - 1;
+#endif
+  frame_queue_publish();
+#endif
+}
+
+/**
+ * @brief Nothing to release, the draw thread ends with the process.
+ */
+void sdl_quit(void) {}
+
+/**
+ * @brief No buttons on the host, input comes from sdl_set_joypad().
+ */
+void button_update(void) {}
+
+/**
+ * @brief Sets the state of all buttons, e.g. from a script.
+ *
+ * @param state Directions in the low nibble and buttons in the high nibble.
+ */
+void sdl_set_joypad(unsigned int state) {
+  unsigned int prev = joypad_state.exchange(state, std::memory_order_relaxed);
+  unsigned int pressed = state & ~prev;
+
+  if (pressed) {
+    joypad_presses.fetch_or(pressed, std::memory_order_relaxed);
+#ifdef LATENCY_PROBE
+    latency_edge(pressed);
+#endif
+  }
+}
+
+unsigned int sdl_get_buttons(void) {
+  return joypad_state.load(std::memory_order_relaxed) >> 4;
+}
+
+unsigned int sdl_get_directions(void) {
+  return joypad_state.load(std::memory_order_relaxed) & 0xF;
+}
+
+unsigned int sdl_take_joypad_presses(void) {
+  if (!joypad_presses.load(std::memory_order_relaxed)) return 0;
+  return joypad_presses.exchange(0, std::memory_order_relaxed);
+}
+
+pixel_t *sdl_get_framebuffer(void) {
+  return frame_buffers[frame_queue_back()];
+}
+
+int sdl_get_framebuffer_index(void) {
+  return frame_queue_back();
+}
+
+const uint16_t *sdl_get_palette(void) {
+  return color_palette;
+}
+
+uint32_t sdl_get_spi_bytes(void) {
+  return spi_bytes;
+}
+
+uint32_t sdl_get_spi_us(void) {
+  return spi_us;
+}
+
+uint32_t sdl_get_interlaced_frames(void) {
+  return 0;
+}
+#endif
@@ -0,0 +1,50 @@
+#include "state.h"
+
+#include <stdlib.h>
+
+#include "cartram.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "lcd.h"
+#include "mbc.h"
+#include "mem.h"
+#include "timer.h"
+
+#ifndef BUILD_FOR_PC
+#include "esp_heap_caps.h"
+#endif
+
+size_t state_size(void) {
+  return mem_state_size() + cpu_state_size() + lcd_state_size() + timer_state_size() +
+         interrupt_state_size() + mbc_state_size() + cart_ram_state_size();
+}
+
+uint8_t *state_alloc(void) {
+#ifdef BUILD_FOR_PC
+  return (uint8_t *)malloc(state_size());
+#else
+  uint8_t *p = (uint8_t *)heap_caps_malloc(state_size(), MALLOC_CAP_SPIRAM);
+  return p ? p : (uint8_t *)malloc(state_size());
+#endif
+}
+
+void state_save(uint8_t *p) {
+  // Memory first, so its 32 KiB block starts aligned
+  p = mem_save_state(p);
+  p = cpu_save_state(p);
+  p = lcd_save_state(p);
+  p = timer_save_state(p);
+  p = interrupt_save_state(p);
+  p = mbc_save_state(p);
+  cart_ram_save_state(p);
+}
+
+void state_load(const uint8_t *p) {
+  p = mem_load_state(p);
+  p = cpu_load_state(p);
+  p = lcd_load_state(p);
+  p = timer_load_state(p);
+  p = interrupt_load_state(p);
+  p = mbc_load_state(p);
+  cart_ram_load_state(p);
+}
@@ -0,0 +1,30 @@
+#ifndef STATE_H
+#define STATE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * In-memory snapshots of the emulated machine: CPU, memory, LCD, timer,
+ * interrupt and mapper state and cartridge RAM and clock in one flat
+ * buffer. Each module lists its state variables in an X-macro and builds
+ * its size, save and load functions from the helpers below; state_save()
+ * and state_load() chain them. Caches derived from the state (LCD luts, background planes,
+ * line memo) are kept coherent on load rather than saved.
+ */
+
+#define STATE_SIZE(v) +sizeof(v)
+#define STATE_SAVE(v) \
+  memcpy(p, &(v), sizeof(v)); \
+  p += sizeof(v);
+#define STATE_LOAD(v) \
+  memcpy(&(v), p, sizeof(v)); \
+  p += sizeof(v);
+
+// Bytes of a snapshot, constant for a loaded ROM
+size_t state_size(void);
+// Allocates a buffer for a snapshot, preferring PSRAM on the device
+uint8_t *state_alloc(void);
+void state_save(uint8_t *buf);
+void state_load(const uint8_t *buf);
+#endif
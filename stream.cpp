@@ -0,0 +1,176 @@
+#include "stream.h"
+
+#include <atomic>
+
+#include "latency.h"
+
+#ifdef BUILD_FOR_PC
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#else
+#include <Arduino.h>
+#include "freertos/queue.h"
+#endif
+
+#define GAMEBOY_HEIGHT 144
+#define NUM_BANDS ((GAMEBOY_HEIGHT + STREAM_BAND - 1) / STREAM_BAND)
+
+// At most one frame of bands waits for the display. When the bus falls
+// behind, newer bands are dropped rather than queued, so latency stays below
+// a frame; the dropped ones are sent again with the next frame.
+#define QUEUE_DEPTH NUM_BANDS
+
+struct band {
+  uint8_t l0, l1;    // Native lines [l0, l1)
+  uint32_t done_us;  // When the last line was rendered
+#ifdef LATENCY_PROBE
+  uint32_t frame;  // Latency probe id of the frame
+#endif
+};
+
+static stream_sink_t band_sink;
+static bool band_changed;              // A line of the current band was redrawn
+static uint8_t band_stale[NUM_BANDS];  // Last attempt to queue the band failed
+
+static std::atomic<uint32_t> bands_sent;
+static std::atomic<uint32_t> bands_dropped;
+static std::atomic<uint32_t> latency_sum;
+static std::atomic<uint32_t> latency_max;
+
+#ifdef LATENCY_PROBE
+// Frame of the newest contents of each band, and of the contents last sent
+static std::atomic<uint32_t> band_changed_frame[NUM_BANDS];
+static std::atomic<uint32_t> band_sent_frame[NUM_BANDS];
+static std::atomic<uint32_t> frame_complete{ UINT32_MAX };  // Newest frame rendered in full
+
+// The display shows a frame, or a newer one, once each band is either up to
+// date or was last sent from that frame or a later one
+static void check_presented(void) {
+  uint32_t frame = frame_complete;
+  for (int i = 0; i < NUM_BANDS; i++) {
+    uint32_t sent = band_sent_frame[i];
+    if ((int32_t)(sent - band_changed_frame[i]) < 0 && (int32_t)(sent - frame) < 0) frame = sent;
+  }
+  latency_presented(frame);
+}
+#endif
+
+static uint32_t now_us(void) {
+#ifdef BUILD_FOR_PC
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return micros();
+#endif
+}
+
+#ifdef BUILD_FOR_PC
+// Never destroyed: the draw thread may still be waiting at exit
+static std::mutex &queue_mutex = *new std::mutex;
+static std::condition_variable &queue_wake = *new std::condition_variable;
+static struct band queue[QUEUE_DEPTH];
+static int queue_head, queue_count;
+
+static bool queue_push(const struct band *b) {
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  if (queue_count == QUEUE_DEPTH) return false;
+  queue[(queue_head + queue_count++) % QUEUE_DEPTH] = *b;
+  queue_wake.notify_one();
+  return true;
+}
+
+static void queue_pop(struct band *b) {
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  queue_wake.wait(lock, [] { return queue_count > 0; });
+  *b = queue[queue_head];
+  queue_head = (queue_head + 1) % QUEUE_DEPTH;
+  queue_count--;
+}
+
+// Matches SPI_FREQ in sdl.cpp
+#define MOCK_SPI_FREQ 40000000
+
+// Bytes of one scaled 240-pixel row, and of the column address, page address
+// and memory write commands that open the window for a band
+#define ROW_BYTES (240 * 2)
+#define WINDOW_BYTES 11
+
+void stream_mock_sink(int l0, int l1) {
+  uint32_t bytes = (l1 * 3 / 2 - l0 * 3 / 2) * ROW_BYTES + WINDOW_BYTES;
+  uint64_t us = (uint64_t)bytes * 8 * 1000000 / MOCK_SPI_FREQ;
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+#else
+static QueueHandle_t queue;
+
+static bool queue_push(const struct band *b) {
+  return xQueueSend(queue, b, 0) == pdTRUE;
+}
+
+static void queue_pop(struct band *b) {
+  xQueueReceive(queue, b, portMAX_DELAY);
+}
+#endif
+
+void stream_init(stream_sink_t sink) {
+  band_sink = sink;
+#ifndef BUILD_FOR_PC
+  queue = xQueueCreate(QUEUE_DEPTH, sizeof(struct band));
+#endif
+}
+
+void stream_line_done(int line, bool changed) {
+  band_changed |= changed;
+  if ((line + 1) % STREAM_BAND && line != GAMEBOY_HEIGHT - 1) return;
+
+  // A band whose lines all hit the memo is already on the display, unless
+  // it could not be queued last time
+  int n = line / STREAM_BAND;
+  if (band_changed || band_stale[n]) {
+    struct band b = { (uint8_t)(n * STREAM_BAND), (uint8_t)(line + 1), now_us() };
+#ifdef LATENCY_PROBE
+    b.frame = latency_frame_id();
+    if (band_changed) band_changed_frame[n] = b.frame;
+#endif
+    band_stale[n] = !queue_push(&b);
+    if (band_stale[n]) bands_dropped++;
+  }
+  band_changed = false;
+
+#ifdef LATENCY_PROBE
+  if (line == GAMEBOY_HEIGHT - 1) {
+    frame_complete = latency_frame_id();
+    check_presented();
+  }
+#endif
+}
+
+void stream_task(void *parameter) {
+  while (true) {
+    struct band b;
+    queue_pop(&b);
+    band_sink(b.l0, b.l1);
+#ifdef LATENCY_PROBE
+    band_sent_frame[b.l0 / STREAM_BAND] = b.frame;
+    check_presented();
+#endif
+
+    uint32_t latency = now_us() - b.done_us;
+    bands_sent++;
+    latency_sum += latency;
+    uint32_t max = latency_max;
+    while (latency > max && !latency_max.compare_exchange_weak(max, latency)) {
+    }
+  }
+}
+
+void stream_read_stats(struct stream_stats *stats) {
+  stats->bands = bands_sent.exchange(0);
+  stats->dropped = bands_dropped.exchange(0);
+  uint32_t sum = latency_sum.exchange(0);
+  stats->latency_avg = stats->bands ? sum / stats->bands : 0;
+  stats->latency_max = latency_max.exchange(0);
+}
@@ -0,0 +1,45 @@
+#ifndef STREAM_H
+#define STREAM_H
+#include <stdint.h>
+
+/*
+ * Beam-racing display output. The renderer reports every finished native
+ * line; each group of STREAM_BAND lines is queued as a band and sent by the
+ * draw task on the other core while the emulator renders the rest of the
+ * frame, so the top of the screen is on the panel before the bottom is drawn.
+ */
+
+// Native lines per band. Even, so a pair of lines scaled to three rows
+// never straddles two bands.
+#ifndef STREAM_BAND
+#define STREAM_BAND 16
+#endif
+
+#if STREAM_BAND % 2
+#error "STREAM_BAND must be even"
+#endif
+
+// Sends native lines [l0, l1) of the frame buffer to the display
+typedef void (*stream_sink_t)(int l0, int l1);
+
+struct stream_stats {
+  uint32_t bands;        // Bands sent
+  uint32_t dropped;      // Bands not queued because the queue was full
+  uint32_t latency_avg;  // Microseconds from the last line of a band being
+  uint32_t latency_max;  // rendered until the band is on the display
+};
+
+void stream_init(stream_sink_t sink);
+// Called after each native line; changed is false when the frame buffer
+// already held the line (line memo hit)
+void stream_line_done(int line, bool changed);
+// Draw task body, sends queued bands in order and never returns
+void stream_task(void *parameter);
+// Counters since the previous call
+void stream_read_stats(struct stream_stats *stats);
+#ifdef BUILD_FOR_PC
+// Display stand-in for host builds: returns after the time the band's bytes
+// take on the SPI bus
+void stream_mock_sink(int l0, int l1);
+#endif
+#endif
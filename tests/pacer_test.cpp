@@ -0,0 +1,78 @@
+/*
+ * Paces thousands of frames on pacer_fake_clock, with emulation times that
+ * vary from frame to frame, and checks that the average frame period is the
+ * DMG frame time FRAME_NUM / FRAME_DEN to the nanosecond, also when frames
+ * run over and are caught up by skipping, and after a stall is forgiven.
+ */
+#include <stdio.h>
+
+#include "pacer.h"
+
+// As in pacer.cpp
+#define FRAME_NUM (70224ull * 1000000000ull)
+#define FRAME_DEN 4194304ull
+
+#define FRAMES 100000
+
+static uint32_t rng_state = 1;
+
+static uint32_t test_random(void) {
+  rng_state = rng_state * 1103515245 + 12345;
+  return rng_state >> 16;
+}
+
+// Runs frames that take work_ns(i) when rendered and a quarter of that when
+// skipped, returns the time they took
+static uint64_t run(int n, uint64_t (*work_ns)(int)) {
+  uint64_t start = pacer_fake_clock.now_ns();
+  for (int i = 0; i < n; i++) {
+    uint64_t ns = work_ns(i);
+    pacer_fake_advance(pacer_frame_begin() ? ns : ns / 4);
+    pacer_frame_end();
+  }
+  return pacer_fake_clock.now_ns() - start;
+}
+
+// Whether n frames taking elapsed ns average the DMG frame time, to within
+// slack_ns over the whole run
+static bool check_period(const char *name, int n, uint64_t elapsed, uint64_t slack_ns) {
+  // elapsed - n * FRAME_NUM / FRAME_DEN, exactly
+  int64_t error = (int64_t)(elapsed * FRAME_DEN - n * FRAME_NUM);
+  bool ok = error > -(int64_t)((slack_ns + 1) * FRAME_DEN) && error < (int64_t)((slack_ns + 1) * FRAME_DEN);
+  printf("%s: %d frames, average period %.4f ns (%.4f expected), %u skipped, %u resyncs\n", name, n,
+         (double)elapsed / n, (double)FRAME_NUM / FRAME_DEN, pacer_get_skipped(), pacer_get_resyncs());
+  return ok;
+}
+
+// 2 to 15 ms, always on time
+static uint64_t light(int i) { return 2000000 + test_random() % 13000000; }
+
+// One frame in ten takes three frames' time, the next ones start a frame
+// behind and are skipped
+static uint64_t heavy(int i) { return i % 10 == 5 ? 50000000 : 10000000 + test_random() % 5000000; }
+
+// A second long stall at the start
+static uint64_t stall(int i) { return i == 0 ? 1000000000 : light(i); }
+
+int main(void) {
+  int failures = 0;
+
+  pacer_init(&pacer_fake_clock);
+  uint64_t elapsed = run(FRAMES, light);
+  if (!check_period("on time", FRAMES, elapsed, 1) || pacer_get_skipped()) failures++;
+
+  // Each overrun is made up by the next frames
+  pacer_init(&pacer_fake_clock);
+  elapsed = run(FRAMES, heavy);
+  if (!check_period("overruns", FRAMES, elapsed, 1) || !pacer_get_skipped() || pacer_get_resyncs()) failures++;
+
+  // The stall is forgiven apart from PACER_MAX_BEHIND frames, which the
+  // next frames catch up, so they take that much less than their time
+  pacer_init(&pacer_fake_clock);
+  run(1, stall);
+  elapsed = run(FRAMES, light) + PACER_MAX_BEHIND * FRAME_NUM / FRAME_DEN;
+  if (!check_period("after a stall", FRAMES, elapsed, 2) || pacer_get_resyncs() != 1) failures++;
+
+  printf("pacer test: %d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,11 @@
+/*
+ * Runs the pixel kernel self test with the backend this file is built for,
+ * see the test target in the Makefile for the instruction sets.
+ */
+#include <stdio.h>
+
+#include "pixel.h"
+
+int main(void) {
+  return pixel_selftest() ? 1 : 0;
+}
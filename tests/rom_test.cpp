@@ -0,0 +1,212 @@
+/*
+ * Writes synthetic ROMs, a 1 MiB MBC1 one and an 8 MiB (512 bank) MBC5 one,
+ * plain and compressed to .gbz, and opens each with every host provider.
+ * Checks every bank the provider hands out, then loads the ROM and selects
+ * every bank through the mapper as a game would, and that hot bank placement
+ * only takes banks that are in memory.
+ *
+ *   rom_test [directory for the ROM files]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "bankcache.h"
+#include "mem.h"
+#include "rom.h"
+#include "romfile.h"
+#include "romprovider.h"
+
+#define BANK_SIZE 0x4000
+
+static const unsigned char logo[] = {
+    0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83,
+    0x00, 0x0C, 0x00, 0x0D, 0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E,
+    0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99, 0xBB, 0xBB, 0x67, 0x63,
+    0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E};
+
+static uint32_t rng_state = 1;
+
+static uint8_t test_random(void) {
+  rng_state = rng_state * 1103515245 + 12345;
+  return rng_state >> 16;
+}
+
+// Each bank starts with its number. Even banks are noise, which does not
+// compress, odd ones a pattern, which does.
+static unsigned char *make_rom(unsigned int banks, unsigned char type, unsigned char size_code) {
+  unsigned char *rom = (unsigned char *)malloc(banks * BANK_SIZE);
+
+  for (unsigned int b = 0; b < banks; b++) {
+    unsigned char *bank = &rom[b * BANK_SIZE];
+    for (int i = 0; i < BANK_SIZE; i++) bank[i] = b & 1 ? (i / 64 + b) & 0xFF : test_random();
+    bank[0] = b;
+    bank[1] = b >> 8;
+  }
+  memset(&rom[0x100], 0, 0x50);
+  memcpy(&rom[0x104], logo, sizeof(logo));
+  memcpy(&rom[0x134], "ROM TEST", 8);
+  rom[0x147] = type;
+  rom[0x148] = size_code;
+  unsigned char checksum = 0;
+  for (int i = 0x134; i <= 0x14C; i++) checksum = checksum - rom[i] - 1;
+  rom[0x14D] = checksum;
+  return rom;
+}
+
+static bool write_file(const char *path, const unsigned char *data, size_t size) {
+  FILE *f = fopen(path, "wb");
+  bool ok = f && fwrite(data, 1, size, f) == size;
+  if (f) fclose(f);
+  return ok;
+}
+
+// Reads every bank, in an order that is neither sequential nor repeating
+static int check_banks(const struct rom_provider *p, const unsigned char *rom, unsigned int banks) {
+  if (p->get_banks() != banks) {
+    printf("  %s: %u banks, expected %u\n", p->name, p->get_banks(), banks);
+    return 1;
+  }
+  for (unsigned int i = 0; i < banks; i++) {
+    unsigned int b = (i * 37 + 11) % banks;
+    if (memcmp(p->get_bank(b), &rom[b * BANK_SIZE], BANK_SIZE)) {
+      printf("  %s: bank %u differs\n", p->name, b);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Whether 0x4000-0x7FFF holds the bank
+static bool switched_to(const unsigned char *rom, unsigned int b) {
+  for (int i = 0; i < BANK_SIZE; i += 97) {
+    if (mem_get_byte(0x4000 + i) != rom[b * BANK_SIZE + i]) return false;
+  }
+  return true;
+}
+
+static int check_mbc1(const unsigned char *rom, unsigned int banks) {
+  for (unsigned int b = 0; b < banks; b++) {
+    mem_write_byte(0x4000, b >> 5);
+    mem_write_byte(0x2000, b & 0x1F);
+    // Bank 0x20 * n can't be selected, the MBC turns it into 0x20 * n + 1
+    unsigned int want = b & 0x1F ? b : b + 1;
+    if (!switched_to(rom, want)) {
+      printf("  MBC1: selecting bank %u does not map bank %u\n", b, want);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int check_mbc5(const unsigned char *rom, unsigned int banks) {
+  for (unsigned int b = 0; b < banks; b++) {
+    unsigned int n = (b * 37 + 11) % banks;
+    mem_write_byte(0x3000, n >> 8);
+    mem_write_byte(0x2000, n & 0xFF);
+    if (!switched_to(rom, n)) {
+      printf("  MBC5: bank %u not mapped\n", n);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Hot bank placement runs on the emulator's thread and must not read the
+// card: a bank the stream pool does not hold is left for later
+static int check_hot_banks(const unsigned char *rom, unsigned int banks) {
+  static uint32_t heat[MEM_HEAT_BANKS];
+  struct bank_cache_stats stats;
+  unsigned int b = banks - 1;
+
+  if (!ROM_HOT_BANKS) return 0;
+  heat[b] = 100;
+  bank_cache_read_stats(&stats);
+  rom_place_hot_banks(heat, MEM_HEAT_BANKS);
+  bank_cache_read_stats(&stats);
+  if (rom_is_hot_bank(b) || stats.misses) {
+    printf("  hot banks: bank %u read from the card for placement\n", b);
+    return 1;
+  }
+  bank_cache_get(b);
+  rom_place_hot_banks(heat, MEM_HEAT_BANKS);
+  heat[b] = 0;
+  if (!rom_is_hot_bank(b) || memcmp(rom_get_bank(b), &rom[b * BANK_SIZE], BANK_SIZE)) {
+    printf("  hot banks: bank %u not placed once in the pool\n", b);
+    return 1;
+  }
+  return 0;
+}
+
+static int test_rom(const std::string &dir, const char *name, unsigned int banks, unsigned char type,
+                    unsigned char size_code, int (*check_mapper)(const unsigned char *, unsigned int)) {
+  unsigned char *rom = make_rom(banks, type, size_code);
+  std::string plain = dir + "/" + name + ".gb", packed = dir + "/" + name + ".gbz";
+  int failures = 0;
+
+  if (!write_file(plain.c_str(), rom, banks * BANK_SIZE) ||
+      !rom_file_compress(plain.c_str(), packed.c_str())) {
+    printf("%s: could not write the ROM files in %s\n", name, dir.c_str());
+    free(rom);
+    return 1;
+  }
+
+  for (const std::string &path : {plain, packed}) {
+    for (int i = 0; rom_providers[i]; i++) {
+      const struct rom_provider *p = rom_providers[i];
+      int f = 0;
+
+      if (!p->open(path.c_str())) {
+        // mmap only maps plain images
+        bool expected = p == &rom_provider_mmap && path == packed;
+        printf("%s %s: %s\n", path.c_str(), p->name, expected ? "skipped" : "failed to open");
+        failures += !expected;
+        continue;
+      }
+      f += check_banks(p, rom, banks);
+      p->close();
+
+      if (!rom_load_from(p, path.c_str())) {
+        printf("  %s: rom_load_from failed\n", p->name);
+        f++;
+      } else {
+        gameboy_mem_init();
+        if (p == &rom_provider_stream) f += check_hot_banks(rom, banks);
+        f += check_mapper(rom, banks);
+        p->close();
+      }
+      printf("%s %s: %s\n", path.c_str(), p->name, f ? "FAILED" : "ok");
+      failures += f;
+    }
+  }
+  free(rom);
+  return failures;
+}
+
+// Rumble carts keep bit 3 of the RAM bank for the motor
+static int check_ram_bank_mask(void) {
+  static const struct { unsigned char type, mask; } carts[] = {{0x1B, 0x0F}, {0x1C, 0x07}, {0x1E, 0x07}};
+  int failures = 0;
+  for (const auto &c : carts) {
+    unsigned char *rom = make_rom(2, c.type, 0x00);
+    if (!rom_init(rom) || rom_get_ram_bank_mask() != c.mask) {
+      printf("  type %02X: RAM bank mask %02X, expected %02X\n", c.type, rom_get_ram_bank_mask(), c.mask);
+      failures++;
+    }
+    free(rom);
+  }
+  return failures;
+}
+
+int main(int argc, char *argv[]) {
+  std::string dir = argc > 1 ? argv[1] : ".";
+  int failures = 0;
+
+  failures += test_rom(dir, "rom_test_mbc1", 64, 0x01, 0x05, check_mbc1);
+  failures += test_rom(dir, "rom_test_mbc5", 512, 0x19, 0x08, check_mbc5);
+  failures += check_ram_bank_mask();
+  printf("rom test: %d failures\n", failures);
+  return failures ? 1 : 0;
+}
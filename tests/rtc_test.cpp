@@ -0,0 +1,90 @@
+/*
+ * Runs the MBC3 clock on rtc_fake_clock(), with the wall clock set and not
+ * set, and checks what the game reads after time passes, with the power on
+ * and off, and the time kept in the .sav footer.
+ */
+#include <stdio.h>
+
+#include "rtc.h"
+
+static int failures;
+
+#define CHECK(c)                                           \
+  do {                                                     \
+    if (!(c)) {                                            \
+      printf("%s:%d: %s failed\n", __FILE__, __LINE__, #c); \
+      failures++;                                          \
+    }                                                      \
+  } while (0)
+
+static uint32_t footer_time(const uint8_t *footer) {
+  return footer[40] | footer[41] << 8 | footer[42] << 16 | (uint32_t)footer[43] << 24;
+}
+
+// Latches and reads seconds, minutes, hours and the low day
+static void read_clock(int *r) {
+  rtc_latch(0);
+  rtc_latch(1);
+  for (int i = 0; i < 4; i++) r[i] = rtc_read(0x08 + i);
+}
+
+static bool clock_is(int s, int m, int h, int d) {
+  int r[4];
+  read_clock(r);
+  if (r[0] == s && r[1] == m && r[2] == h && r[3] == d) return true;
+  printf("clock %d:%02d:%02d day %d, expected %d:%02d:%02d day %d\n", r[2], r[1], r[0], r[3], h, m, s, d);
+  return false;
+}
+
+int main(void) {
+  uint8_t footer[RTC_FOOTER_SIZE], unset_footer[RTC_FOOTER_SIZE];
+  const int64_t now = 1800000000;  // 2027
+
+  // Wall clock not set: the clock runs on the time since boot
+  rtc_fake_clock(1000, 50);
+  rtc_init(0x10);
+  rtc_write(0x08, 10);
+  rtc_write(0x0A, 5);
+  rtc_fake_clock(1000 + 125, 50 + 125);
+  CHECK(clock_is(15, 2, 5, 0));
+  // Saved again once a minute, as the time of the last write is all the
+  // next boot would know
+  CHECK(rtc_footer_due());
+  CHECK(!rtc_footer_due());
+  rtc_save_footer(footer);
+  CHECK(footer_time(footer) >= RTC_WALL_CLOCK_SET);
+
+  // Next boot, still not set: no time passed while the power was off
+  rtc_fake_clock(1000, 3);
+  rtc_init(0x10);
+  rtc_load_footer(footer, RTC_FOOTER_SIZE);
+  CHECK(clock_is(15, 2, 5, 0));
+  rtc_fake_clock(1000, 3 + 60);
+  CHECK(clock_is(15, 3, 5, 0));
+  CHECK(rtc_footer_due());
+  rtc_save_footer(footer);
+
+  // Set, an hour after the footer's time: that hour is added
+  rtc_fake_clock(footer_time(footer) + 3600, 7);
+  rtc_init(0x10);
+  rtc_load_footer(footer, RTC_FOOTER_SIZE);
+  CHECK(clock_is(15, 3, 6, 0));
+  rtc_fake_clock(footer_time(footer) + 3600 + 86400, 8);
+  CHECK(clock_is(15, 3, 6, 1));
+  // The wall clock keeps the time, the footer is only saved on writes
+  CHECK(!rtc_footer_due());
+
+  // A footer saved with a time from 1970 adds no decades
+  for (int i = 0; i < RTC_FOOTER_SIZE; i++) unset_footer[i] = footer[i];
+  unset_footer[40] = 100;
+  unset_footer[41] = unset_footer[42] = unset_footer[43] = unset_footer[44] = 0;
+  rtc_fake_clock(now, 9);
+  rtc_init(0x10);
+  rtc_load_footer(unset_footer, RTC_FOOTER_SIZE);
+  CHECK(clock_is(15, 3, 5, 0));
+  rtc_save_footer(footer);
+  CHECK(footer_time(footer) == now);
+
+  printf("rtc test: %d failures\n", failures);
+  return failures ? 1 : 0;
+}
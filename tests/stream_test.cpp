@@ -0,0 +1,88 @@
+/*
+ * Streams frames through stream_line_done() to stream_mock_sink() on a draw
+ * thread, as sdl_pc.cpp does with SDL_STREAM_LINES, and checks which bands
+ * reach the sink: every band of a redrawn frame, none of an unchanged one,
+ * and bands dropped while the bus is behind on the next frame.
+ */
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "stream.h"
+
+#define GAMEBOY_HEIGHT 144
+#define NUM_BANDS ((GAMEBOY_HEIGHT + STREAM_BAND - 1) / STREAM_BAND)
+
+// A little slower than the device renders a line
+#define LINE_US 120
+
+static std::atomic<int> bad_bands;
+
+static void checking_sink(int l0, int l1) {
+  int end = l0 + STREAM_BAND < GAMEBOY_HEIGHT ? l0 + STREAM_BAND : GAMEBOY_HEIGHT;
+  if (l0 % STREAM_BAND || l1 != end) bad_bands++;
+  stream_mock_sink(l0, l1);
+}
+
+static void frame(bool changed, bool paced) {
+  for (int line = 0; line < GAMEBOY_HEIGHT; line++) {
+    if (paced) std::this_thread::sleep_for(std::chrono::microseconds(LINE_US));
+    stream_line_done(line, changed);
+  }
+}
+
+// Lets the draw thread send what is queued
+static void drain(void) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+}
+
+int main(void) {
+  struct stream_stats stats;
+  int failures = 0;
+
+  stream_init(checking_sink);
+  std::thread(stream_task, (void *)NULL).detach();
+
+  frame(true, true);
+  drain();
+  stream_read_stats(&stats);
+  printf("redrawn frame: %u bands, %u dropped, latency avg %u us max %u us\n",
+         stats.bands, stats.dropped, stats.latency_avg, stats.latency_max);
+  if (stats.bands != NUM_BANDS || stats.dropped) failures++;
+
+  frame(false, true);
+  drain();
+  stream_read_stats(&stats);
+  printf("unchanged frame: %u bands\n", stats.bands);
+  if (stats.bands || stats.dropped) failures++;
+
+  // Faster than the bus can take them, the queue holds one frame
+  for (int i = 0; i < 3; i++) frame(true, false);
+  drain();
+  stream_read_stats(&stats);
+  uint32_t dropped = stats.dropped;
+  printf("3 frames at once: %u bands, %u dropped\n", stats.bands, dropped);
+  if (!dropped || stats.bands + dropped != 3 * NUM_BANDS) failures++;
+
+  // The bands dropped last are sent again though nothing changed
+  frame(false, true);
+  drain();
+  stream_read_stats(&stats);
+  printf("unchanged frame after drops: %u bands\n", stats.bands);
+  if (!stats.bands || stats.bands > NUM_BANDS || stats.dropped) failures++;
+
+  frame(false, true);
+  drain();
+  stream_read_stats(&stats);
+  printf("unchanged frame: %u bands\n", stats.bands);
+  if (stats.bands || stats.dropped) failures++;
+
+  if (bad_bands) {
+    printf("%d bands with wrong lines\n", bad_bands.load());
+    failures++;
+  }
+  printf("stream test: %d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -7,6 +7,7 @@
 
 #include "cpu.h"
 #include "interrupt.h"
+#include "state.h"
 
 static unsigned int prev_time;
 static unsigned int elapsed;
@@ -19,6 +20,23 @@ static unsigned int counter;
 static unsigned int divider;
 static unsigned int modulo;
 
+/* Saved for snapshots */
+#define TIMER_STATE(X)                                                         \
+  X(prev_time) X(elapsed) X(ticks) X(tac) X(started) X(speed) X(counter)       \
+  X(divider) X(modulo)
+
+size_t timer_state_size(void) { return 0 TIMER_STATE(STATE_SIZE); }
+
+uint8_t *timer_save_state(uint8_t *p) {
+  TIMER_STATE(STATE_SAVE)
+  return p;
+}
+
+const uint8_t *timer_load_state(const uint8_t *p) {
+  TIMER_STATE(STATE_LOAD)
+  return p;
+}
+
 void timer_set_div(unsigned char v) {
   (void)v;
   divider = 0;
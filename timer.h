@@ -1,5 +1,8 @@
 #ifndef TIMER_H
 #define TIMER_H
+#include <stddef.h>
+#include <stdint.h>
+
 void timer_set_tac(unsigned char);
 void timer_cycle(unsigned int cycles);
 unsigned char timer_get_div(void);
@@ -9,4 +12,7 @@ unsigned char timer_get_tac(void);
 void timer_set_div(unsigned char);
 void timer_set_counter(unsigned char);
 void timer_set_modulo(unsigned char);
+size_t timer_state_size(void);
+uint8_t *timer_save_state(uint8_t *p);
+const uint8_t *timer_load_state(const uint8_t *p);
 #endif
\ No newline at end of file